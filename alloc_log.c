@@ -0,0 +1,261 @@
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alloc_log.h"
+#include "lock.h"
+#include "mymalloc_internal.h"
+#include "page_alloc.h"
+
+typedef struct LogRing_ {
+  _Atomic uint64_t head;
+  _Atomic uint64_t tail;
+  atomic_flag draining;
+  atomic_int in_use;
+  struct LogRing_ *next;
+  LogRecord records[LOG_RING_SIZE];
+} LogRing;
+
+atomic_int log_enabled = 1;
+static _Atomic(LogRing *) log_rings = NULL;
+static _Thread_local LogRing *log_ring = NULL;
+static _Thread_local uint32_t log_thread_id = 0;
+static _Atomic uint32_t log_thread_count = 0;
+static uint32_t log_process_id = 0;
+
+/* Protects the file descriptor and the mapped window */
+static Lock log_lock = LOCK_INITIALIZER;
+static int log_fd = -1;
+static LogFileHeader *log_header = NULL;
+static char *log_window = NULL;
+static uint64_t log_window_offset = 0;
+
+void log_set_enabled(int enabled) { log_enabled = enabled; }
+
+static int log_header_valid(LogFileHeader *header) {
+  return memcmp(header->magic, LOG_MAGIC, sizeof(header->magic)) == 0 &&
+         header->version == LOG_VERSION &&
+         header->record_size == sizeof(LogRecord);
+}
+
+static int log_map_header() {
+  if (log_fd < 0) {
+    log_fd = open(LOG_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log_fd < 0)
+      return 0;
+  }
+  struct stat st;
+  if (fstat(log_fd, &st) != 0)
+    return 0;
+  if (st.st_size < (off_t)sizeof(LogFileHeader) &&
+      posix_fallocate(log_fd, 0, sizeof(LogFileHeader)) != 0) {
+    return 0;
+  }
+  LogFileHeader *header =
+      (LogFileHeader *)mmap(NULL, sizeof(LogFileHeader),
+                            PROT_READ | PROT_WRITE, MAP_SHARED, log_fd, 0);
+  if (header == MAP_FAILED)
+    return 0;
+  if (!log_header_valid(header)) {
+    /* Empty file or an older format: start a new trace */
+    memcpy(header->magic, LOG_MAGIC, sizeof(header->magic));
+    header->version = LOG_VERSION;
+    header->record_size = sizeof(LogRecord);
+    atomic_store(&header->end, sizeof(LogFileHeader));
+    atomic_store(&header->sequence, 0);
+    atomic_store(&header->processes, 0);
+  }
+  log_header = header;
+  log_process_id = (uint32_t)atomic_fetch_add(&header->processes, 1) + 1;
+  return 1;
+}
+
+/* A file that cannot be set up, e.g. in a directory the process cannot
+   write to, turns logging off rather than being tried again by every
+   operation under log_lock. log_set_enabled(1) tries it once more */
+static int log_open_locked() {
+  if (log_header != NULL)
+    return 1;
+  if (log_map_header())
+    return 1;
+  atomic_store_explicit(&log_enabled, 0, memory_order_relaxed);
+  return 0;
+}
+
+static int log_open() {
+  lock_acquire(log_lock);
+  int opened = log_open_locked();
+  lock_release(log_lock);
+  return opened;
+}
+
+static uint32_t log_new_thread_id() {
+  return log_process_id << LOG_THREAD_BITS |
+         ((atomic_fetch_add(&log_thread_count, 1) + 1) &
+          ((1u << LOG_THREAD_BITS) - 1));
+}
+
+static int log_map_window(uint64_t offset) {
+  if (log_window != NULL) {
+    munmap(log_window, LOG_MAP_WINDOW);
+    log_window = NULL;
+  }
+  uint64_t window_offset = offset & ~(uint64_t)(PAGE_DIV - 1);
+  if (posix_fallocate(log_fd, window_offset, LOG_MAP_WINDOW) != 0)
+    return 0;
+  char *window = (char *)mmap(NULL, LOG_MAP_WINDOW, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, log_fd, window_offset);
+  if (window == MAP_FAILED)
+    return 0;
+  log_window = window;
+  log_window_offset = window_offset;
+  return 1;
+}
+
+static void log_append(const LogRecord *records, size_t count) {
+  const char *data = (const char *)records;
+  size_t bytes = count * sizeof(LogRecord);
+  lock_acquire(log_lock);
+  if (log_open_locked()) {
+    uint64_t offset = atomic_fetch_add(&log_header->end, bytes);
+    while (bytes > 0) {
+      if (log_window == NULL || offset < log_window_offset ||
+          offset >= log_window_offset + LOG_MAP_WINDOW) {
+        if (!log_map_window(offset))
+          break;
+      }
+      size_t room = log_window_offset + LOG_MAP_WINDOW - offset;
+      size_t n = bytes < room ? bytes : room;
+      memcpy(log_window + (offset - log_window_offset), data, n);
+      offset += n;
+      data += n;
+      bytes -= n;
+    }
+  }
+  lock_release(log_lock);
+}
+
+/* Only one thread drains a ring at a time, the owner keeps pushing
+   while it happens */
+static void log_drain(LogRing *ring) {
+  while (atomic_flag_test_and_set_explicit(&ring->draining,
+                                           memory_order_acquire)) {
+    ;
+  }
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (head != tail) {
+    size_t first = tail % LOG_RING_SIZE;
+    size_t count = head - tail;
+    if (first + count > LOG_RING_SIZE) {
+      log_append(ring->records + first, LOG_RING_SIZE - first);
+      log_append(ring->records, first + count - LOG_RING_SIZE);
+    } else {
+      log_append(ring->records + first, count);
+    }
+    atomic_store_explicit(&ring->tail, head, memory_order_release);
+  }
+  atomic_flag_clear_explicit(&ring->draining, memory_order_release);
+}
+
+static LogRing *log_claim_ring() {
+  for (LogRing *ring = log_rings; ring != NULL; ring = ring->next) {
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&ring->in_use, &expected, 1)) {
+      return ring;
+    }
+  }
+  LogRing *ring = (LogRing *)page_alloc(sizeof(LogRing));
+  if (ring == NULL)
+    return NULL;
+  ring->head = 0;
+  ring->tail = 0;
+  atomic_flag_clear(&ring->draining);
+  ring->in_use = 1;
+  ring->next = log_rings;
+  while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring)) {
+    ;
+  }
+  return ring;
+}
+
+void log_event(LogOp op, void *pointer, void *old_pointer, size_t size,
+               int16_t heap_index) {
+  if (!atomic_load_explicit(&log_enabled, memory_order_relaxed))
+    return;
+  LogRing *ring = log_ring;
+  if (ring == NULL) {
+    if (!log_open() || (ring = log_claim_ring()) == NULL)
+      return;
+    log_ring = ring;
+    if (log_thread_id == 0)
+      log_thread_id = log_new_thread_id();
+  }
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >=
+      LOG_RING_SIZE) {
+    log_drain(ring);
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  LogRecord *record = ring->records + head % LOG_RING_SIZE;
+  record->sequence =
+      atomic_fetch_add_explicit(&log_header->sequence, 1, memory_order_relaxed);
+  record->time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  record->address = (uint64_t)(uintptr_t)pointer;
+  record->old_address = (uint64_t)(uintptr_t)old_pointer;
+  record->size = size;
+  record->thread_id = log_thread_id;
+  record->heap_index = heap_index;
+  record->op = (uint8_t)op;
+  record->reserved = 0;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  if (head + 1 - atomic_load_explicit(&ring->tail, memory_order_relaxed) >=
+      LOG_FLUSH_THRESHOLD) {
+    log_drain(ring);
+  }
+}
+
+void log_thread_exit() {
+  LogRing *ring = log_ring;
+  if (ring != NULL) {
+    log_drain(ring);
+    log_ring = NULL;
+    atomic_store(&ring->in_use, 0);
+  }
+}
+
+__attribute__((destructor)) void log_flush_all() {
+  for (LogRing *ring = log_rings; ring != NULL; ring = ring->next) {
+    log_drain(ring);
+  }
+}
+
+void log_fork_prepare() { lock_acquire(log_lock); }
+
+void log_fork_parent() { lock_release(log_lock); }
+
+/* Only the forking thread lives on in the child. Pending records are
+   written by the parent, so the child drops them and frees the rings of
+   the threads it does not have. The child numbers itself and the forking
+   thread anew */
+void log_fork_child() {
+  lock_release(log_lock);
+  if (log_header != NULL) {
+    log_process_id =
+        (uint32_t)atomic_fetch_add(&log_header->processes, 1) + 1;
+    log_thread_count = 0;
+    if (log_thread_id != 0)
+      log_thread_id = log_new_thread_id();
+  }
+  for (LogRing *ring = log_rings; ring != NULL; ring = ring->next) {
+    atomic_store(&ring->tail, atomic_load(&ring->head));
+    atomic_flag_clear(&ring->draining);
+    if (ring != log_ring)
+      atomic_store(&ring->in_use, 0);
+  }
+}
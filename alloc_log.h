@@ -0,0 +1,84 @@
+#ifndef ALLOC_LOG_HEADER
+#define ALLOC_LOG_HEADER
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Records are buffered in a per-thread ring of LOG_RING_SIZE entries and
+   appended to LOG_FILE once LOG_FLUSH_THRESHOLD of them are pending */
+#define LOG_RING_SIZE 1024
+#define LOG_FLUSH_THRESHOLD (LOG_RING_SIZE / 2)
+
+/* LOG_FILE is written through shared mappings of LOG_MAP_WINDOW bytes */
+#define LOG_MAP_WINDOW (4 << 20)
+
+#define LOG_MAGIC "MYMLOG\0"
+#define LOG_VERSION 3
+
+typedef enum {
+  LOG_OP_MALLOC = 1,
+  LOG_OP_FREE = 2,
+  LOG_OP_REALLOC = 3
+} LogOp;
+
+/* A record's thread_id holds the number of its process in the file above
+   LOG_THREAD_BITS and the number of its thread in that process below */
+#define LOG_THREAD_BITS 16
+#define LOG_PROCESS_OF(thread_id) ((thread_id) >> LOG_THREAD_BITS)
+
+/* Starts the file. end is the file offset where the next record goes;
+   it, sequence and processes are shared by every process appending to
+   the file */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  _Atomic uint64_t end;
+  _Atomic uint64_t sequence;
+  _Atomic uint64_t processes;
+  uint64_t reserved[3];
+} LogFileHeader;
+
+/* Fixed-size record. Records are grouped per thread in the file; sequence
+   orders them across threads and processes. A malloc is numbered once
+   it returned and a free before the memory is released, so sorting by
+   sequence never puts a malloc before the free of the same address. A
+   record with op 0 was reserved but never written */
+typedef struct {
+  uint64_t sequence;
+  uint64_t time_ns;
+  uint64_t address;
+  uint64_t old_address;
+  uint64_t size;
+  uint32_t thread_id;
+  int16_t heap_index;
+  uint8_t op;
+  uint8_t reserved;
+} LogRecord;
+
+extern atomic_int log_enabled;
+
+void log_set_enabled(int enabled);
+
+/** @brief Whether operations are recorded. Callers check it before
+    looking up what a record needs, log_event checks it again */
+static inline int log_is_enabled() {
+  return atomic_load_explicit(&log_enabled, memory_order_relaxed);
+}
+
+/** @brief Record an operation. old_pointer is only meaningful for realloc */
+void log_event(LogOp op, void *pointer, void *old_pointer, size_t size,
+               int16_t heap_index);
+
+/** @brief Write out and release the calling thread's ring */
+void log_thread_exit();
+
+/** @brief Write out the pending records of every thread */
+void log_flush_all();
+
+/* Called around fork by the allocator's own fork handlers */
+void log_fork_prepare();
+void log_fork_parent();
+void log_fork_child();
+
+#endif /*ALLOC_LOG_HEADER*/
@@ -0,0 +1,116 @@
+#include "mymalloc.h"
+#include "mymalloc_internal.h"
+#include "chunk_pool.h"
+#include "page_alloc.h"
+
+/* Starts every chunk of an arena. Chunks stay in one list across resets,
+   allocation fills them in list order */
+typedef struct ArenaChunk_ {
+  struct ArenaChunk_ *next;
+  size_t size;
+} ArenaChunk;
+
+#define ARENA_CHUNK_HEADER_SIZE                                                \
+  (MEM_ALIGN * ((sizeof(ArenaChunk) + MEM_ALIGN - 1) / MEM_ALIGN))
+
+/* Lives at the start of the first chunk */
+struct MyArena_ {
+  ArenaChunk *first;
+  /* Chunk being filled, from top to end */
+  ArenaChunk *current;
+  char *top;
+  char *end;
+  /* Size of the next chunk to map */
+  size_t chunk_size;
+};
+
+#define ARENA_HEADER_SIZE                                                      \
+  (MEM_ALIGN * ((sizeof(MyArena) + MEM_ALIGN - 1) / MEM_ALIGN))
+
+static size_t fit_to_page(size_t size) {
+  return (PAGE_DIV * ((size + PAGE_DIV - 1) / PAGE_DIV));
+}
+
+static ArenaChunk *arena_chunk_new(size_t size) {
+  ArenaChunk *chunk = (ArenaChunk *)chunk_pool_get(size, PAGE_DIV);
+  if (chunk == NULL)
+    chunk = (ArenaChunk *)page_alloc(size);
+  if (chunk == NULL)
+    return NULL;
+  chunk->next = NULL;
+  chunk->size = size;
+  return chunk;
+}
+
+static void arena_use(MyArena *arena, ArenaChunk *chunk) {
+  arena->current = chunk;
+  arena->top = (char *)chunk + ARENA_CHUNK_HEADER_SIZE;
+  if (chunk == arena->first)
+    arena->top += ARENA_HEADER_SIZE;
+  arena->end = (char *)chunk + chunk->size;
+}
+
+MyArena *my_arena_create() {
+  ArenaChunk *chunk = arena_chunk_new(ARENA_CHUNK_SIZE);
+  if (chunk == NULL)
+    return NULL;
+  MyArena *arena = (MyArena *)((char *)chunk + ARENA_CHUNK_HEADER_SIZE);
+  arena->first = chunk;
+  arena->chunk_size = 2 * ARENA_CHUNK_SIZE;
+  arena_use(arena, chunk);
+  return arena;
+}
+
+/* Moves on to the next chunk that can hold size bytes. The chunks it
+   skips stay unused until the next reset */
+static int arena_next_chunk(MyArena *arena, size_t size) {
+  ArenaChunk *chunk = arena->current;
+  while (chunk->next != NULL) {
+    chunk = chunk->next;
+    if (chunk->size - ARENA_CHUNK_HEADER_SIZE >= size) {
+      arena_use(arena, chunk);
+      return 1;
+    }
+  }
+  if (size > SIZE_MAX - ARENA_CHUNK_HEADER_SIZE - PAGE_DIV)
+    return 0;
+  size_t chunk_size = fit_to_page(size + ARENA_CHUNK_HEADER_SIZE);
+  if (chunk_size < arena->chunk_size)
+    chunk_size = arena->chunk_size;
+  ArenaChunk *fresh = arena_chunk_new(chunk_size);
+  if (fresh == NULL)
+    return 0;
+  if (arena->chunk_size < ARENA_CHUNK_MAX_SIZE)
+    arena->chunk_size *= 2;
+  /* Right after the current chunk, so a reset reuses it first */
+  fresh->next = arena->current->next;
+  arena->current->next = fresh;
+  arena_use(arena, fresh);
+  return 1;
+}
+
+void *my_arena_alloc(MyArena *arena, size_t size) {
+  /* Rounding up would wrap around to a small size */
+  if (size > SIZE_MAX - MEM_ALIGN)
+    return NULL;
+  size = fit_to_memalign(size);
+  if ((size_t)(arena->end - arena->top) < size &&
+      !arena_next_chunk(arena, size))
+    return NULL;
+  void *pointer = arena->top;
+  arena->top += size;
+  return pointer;
+}
+
+void my_arena_reset(MyArena *arena) { arena_use(arena, arena->first); }
+
+void my_arena_destroy(MyArena *arena) {
+  ArenaChunk *chunk = arena->first->next;
+  while (chunk != NULL) {
+    ArenaChunk *next = chunk->next;
+    chunk_pool_put(chunk, chunk->size);
+    chunk = next;
+  }
+  /* The arena itself goes last */
+  chunk_pool_put(arena->first, arena->first->size);
+}
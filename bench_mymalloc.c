@@ -0,0 +1,438 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mymalloc.h"
+
+/* Latencies go in HISTOGRAM_SUB buckets per power of two of nanoseconds */
+#define HISTOGRAM_SUB_LOG2 3
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_LOG2)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB)
+
+/* Only one operation in LATENCY_SAMPLE_EVERY is timed, so that reading
+   the clock does not dominate the throughput */
+#define LATENCY_SAMPLE_EVERY 8
+
+#define MAX_THREADS 256
+#define LARSON_SLOTS 1000
+#define RING_CAPACITY 64
+#define BATCH_SIZE 64
+
+typedef struct {
+  const char *name;
+  void *(*malloc)(size_t size);
+  void (*free)(void *pointer);
+  void *(*realloc)(void *pointer, size_t size);
+} Allocator;
+
+static const Allocator allocators[] = {
+    {"mymalloc", my_malloc, my_free, my_realloc},
+    {"glibc", malloc, free, realloc},
+};
+
+typedef struct {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+} Histogram;
+
+typedef struct ThreadContext_ ThreadContext;
+
+typedef struct {
+  const char *name;
+  const char *description;
+  void (*run)(ThreadContext *context);
+} Workload;
+
+/* Producer/consumer batches travel through single producer, single
+   consumer rings */
+typedef struct {
+  _Atomic uint64_t head;
+  _Atomic uint64_t tail;
+  void **batches[RING_CAPACITY];
+} Ring;
+
+typedef struct {
+  const Allocator *allocator;
+  size_t ops_per_thread;
+  int threads;
+  Ring rings[MAX_THREADS];
+  void **larson_slots[MAX_THREADS];
+  pthread_barrier_t barrier;
+} Run;
+
+struct ThreadContext_ {
+  Run *run;
+  int index;
+  unsigned seed;
+  uint64_t ops;
+  uint64_t samples;
+  Histogram histogram;
+};
+
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static int histogram_bucket(uint64_t ns) {
+  if (ns < HISTOGRAM_SUB)
+    return (int)ns;
+  int exponent = 63 - __builtin_clzll(ns);
+  int sub = (int)(ns >> (exponent - HISTOGRAM_SUB_LOG2)) & (HISTOGRAM_SUB - 1);
+  return (exponent - HISTOGRAM_SUB_LOG2 + 1) * HISTOGRAM_SUB + sub;
+}
+
+/* Lower bound of the latencies counted in bucket */
+static uint64_t histogram_value(int bucket) {
+  if (bucket < HISTOGRAM_SUB)
+    return (uint64_t)bucket;
+  int exponent = bucket / HISTOGRAM_SUB + HISTOGRAM_SUB_LOG2 - 1;
+  uint64_t sub = (uint64_t)(bucket % HISTOGRAM_SUB);
+  return ((uint64_t)1 << exponent) | (sub << (exponent - HISTOGRAM_SUB_LOG2));
+}
+
+static uint64_t histogram_percentile(const Histogram *histogram,
+                                     uint64_t total, double percentile) {
+  uint64_t rank = (uint64_t)(percentile * (double)total);
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen > rank)
+      return histogram_value(i);
+  }
+  return 0;
+}
+
+/* Times one operation in LATENCY_SAMPLE_EVERY */
+#define TIMED(context, operation)                                              \
+  do {                                                                         \
+    if (((context)->ops++ % LATENCY_SAMPLE_EVERY) == 0) {                      \
+      uint64_t start_ = now_ns();                                              \
+      operation;                                                               \
+      (context)->histogram.counts[histogram_bucket(now_ns() - start_)]++;      \
+      (context)->samples++;                                                    \
+    } else {                                                                   \
+      operation;                                                               \
+    }                                                                          \
+  } while (0)
+
+static size_t random_size(ThreadContext *context, size_t min, size_t max) {
+  return min + (size_t)rand_r(&context->seed) % (max - min + 1);
+}
+
+static void touch(void *pointer, size_t size) {
+  if (size > 0) {
+    ((volatile char *)pointer)[0] = 1;
+    ((volatile char *)pointer)[size - 1] = 1;
+  }
+}
+
+/* Allocates and frees the same size over and over */
+static void run_churn(ThreadContext *context) {
+  const Allocator *allocator = context->run->allocator;
+  size_t rounds = context->run->ops_per_thread / 2;
+  void *pointer;
+  for (size_t i = 0; i < rounds; i++) {
+    TIMED(context, pointer = allocator->malloc(64));
+    touch(pointer, 64);
+    TIMED(context, allocator->free(pointer));
+  }
+}
+
+/* Keeps a window of live blocks of random sizes, replacing one per round */
+static void run_random(ThreadContext *context) {
+  const Allocator *allocator = context->run->allocator;
+  size_t rounds = context->run->ops_per_thread / 2;
+  void *live[LARSON_SLOTS] = {NULL};
+  for (size_t i = 0; i < rounds; i++) {
+    size_t slot = (size_t)rand_r(&context->seed) % LARSON_SLOTS;
+    size_t size = random_size(context, 8, 4096);
+    if (live[slot] != NULL)
+      TIMED(context, allocator->free(live[slot]));
+    TIMED(context, live[slot] = allocator->malloc(size));
+    touch(live[slot], size);
+  }
+  for (int slot = 0; slot < LARSON_SLOTS; slot++) {
+    allocator->free(live[slot]);
+  }
+}
+
+static void ring_push(Ring *ring, void **batch) {
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >=
+         RING_CAPACITY) {
+    sched_yield();
+  }
+  ring->batches[head % RING_CAPACITY] = batch;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void **ring_pop(Ring *ring) {
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+    sched_yield();
+  }
+  void **batch = ring->batches[tail % RING_CAPACITY];
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return batch;
+}
+
+/* Every thread allocates batches that the next thread frees */
+static void run_producer_consumer(ThreadContext *context) {
+  Run *run = context->run;
+  const Allocator *allocator = run->allocator;
+  size_t rounds = run->ops_per_thread / (2 * BATCH_SIZE);
+  Ring *outbound = run->rings + (context->index + 1) % run->threads;
+  Ring *inbound = run->rings + context->index;
+  for (size_t i = 0; i < rounds; i++) {
+    /* Batch arrays are bookkeeping, kept out of the measured allocator */
+    void **batch = (void **)malloc(BATCH_SIZE * sizeof(void *));
+    for (int k = 0; k < BATCH_SIZE; k++) {
+      size_t size = random_size(context, 16, 512);
+      TIMED(context, batch[k] = allocator->malloc(size));
+      touch(batch[k], size);
+    }
+    ring_push(outbound, batch);
+    batch = ring_pop(inbound);
+    for (int k = 0; k < BATCH_SIZE; k++) {
+      TIMED(context, allocator->free(batch[k]));
+    }
+    free(batch);
+  }
+}
+
+/* Server simulation after the larson benchmark: each thread replaces
+   random blocks of its slots, then takes over the slots of the previous
+   thread, freeing blocks allocated elsewhere */
+static void run_larson(ThreadContext *context) {
+  Run *run = context->run;
+  const Allocator *allocator = run->allocator;
+  size_t rounds = run->ops_per_thread / 2;
+  void **slots = (void **)calloc(LARSON_SLOTS, sizeof(void *));
+  for (int phase = 0; phase < 4; phase++) {
+    for (size_t i = 0; i < rounds / 4; i++) {
+      size_t slot = (size_t)rand_r(&context->seed) % LARSON_SLOTS;
+      size_t size = random_size(context, 16, 1024);
+      if (slots[slot] != NULL)
+        TIMED(context, allocator->free(slots[slot]));
+      TIMED(context, slots[slot] = allocator->malloc(size));
+      touch(slots[slot], size);
+    }
+    run->larson_slots[context->index] = slots;
+    pthread_barrier_wait(&run->barrier);
+    slots = run->larson_slots[(context->index + run->threads - 1) %
+                              run->threads];
+    pthread_barrier_wait(&run->barrier);
+  }
+  for (int slot = 0; slot < LARSON_SLOTS; slot++) {
+    allocator->free(slots[slot]);
+  }
+  free(slots);
+}
+
+/* Grows buffers by half their size up to 64 KiB */
+static void run_realloc(ThreadContext *context) {
+  const Allocator *allocator = context->run->allocator;
+  while (context->ops < context->run->ops_per_thread) {
+    size_t size = 16;
+    void *pointer;
+    TIMED(context, pointer = allocator->malloc(size));
+    while (size < 64 * 1024) {
+      size += size / 2;
+      TIMED(context, pointer = allocator->realloc(pointer, size));
+      touch(pointer, size);
+    }
+    TIMED(context, allocator->free(pointer));
+  }
+}
+
+static const Workload workloads[] = {
+    {"churn", "malloc/free of one size", run_churn},
+    {"random", "random sizes 8-4096", run_random},
+    {"prodcons", "frees by the next thread", run_producer_consumer},
+    {"larson", "server simulation", run_larson},
+    {"realloc", "realloc growth to 64 KiB", run_realloc},
+};
+
+#define NUMBER_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+typedef struct {
+  ThreadContext *context;
+  const Workload *workload;
+} ThreadArgs;
+
+static void *thread_main(void *args) {
+  ThreadArgs *thread_args = (ThreadArgs *)args;
+  thread_args->workload->run(thread_args->context);
+  return NULL;
+}
+
+/* Resets the peak RSS of the process where the kernel allows it */
+static void reset_peak_rss() {
+  FILE *file = fopen("/proc/self/clear_refs", "w");
+  if (file != NULL) {
+    fputs("5", file);
+    fclose(file);
+  }
+}
+
+/* Peak RSS in KiB */
+static long peak_rss() {
+  FILE *file = fopen("/proc/self/status", "r");
+  if (file != NULL) {
+    char line[256];
+    long kib = -1;
+    while (fgets(line, sizeof(line), file) != NULL) {
+      if (sscanf(line, "VmHWM: %ld", &kib) == 1)
+        break;
+    }
+    fclose(file);
+    if (kib >= 0)
+      return kib;
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static void run_workload(const Allocator *allocator, const Workload *workload,
+                         int threads, size_t ops_per_thread) {
+  Run *run = (Run *)calloc(1, sizeof(Run));
+  ThreadContext *contexts =
+      (ThreadContext *)calloc((size_t)threads, sizeof(ThreadContext));
+  ThreadArgs args[MAX_THREADS];
+  pthread_t ids[MAX_THREADS];
+  run->allocator = allocator;
+  run->ops_per_thread = ops_per_thread;
+  run->threads = threads;
+  pthread_barrier_init(&run->barrier, NULL, (unsigned)threads);
+  reset_peak_rss();
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < threads; i++) {
+    contexts[i].run = run;
+    contexts[i].index = i;
+    contexts[i].seed = 12345u + (unsigned)i;
+    args[i].context = contexts + i;
+    args[i].workload = workload;
+    if (pthread_create(ids + i, NULL, thread_main, args + i) != 0) {
+      fprintf(stderr, "ERROR: cannot start thread %d\n", i);
+      exit(1);
+    }
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  Histogram *total = (Histogram *)calloc(1, sizeof(Histogram));
+  uint64_t ops = 0;
+  uint64_t samples = 0;
+  for (int i = 0; i < threads; i++) {
+    ops += contexts[i].ops;
+    samples += contexts[i].samples;
+    for (int k = 0; k < HISTOGRAM_BUCKETS; k++) {
+      total->counts[k] += contexts[i].histogram.counts[k];
+    }
+  }
+  printf("%-9s %-9s %3d %12.0f %8llu %8llu %8llu %10ld\n", allocator->name,
+         workload->name, threads, (double)ops * 1e9 / (double)elapsed,
+         (unsigned long long)histogram_percentile(total, samples, 0.50),
+         (unsigned long long)histogram_percentile(total, samples, 0.99),
+         (unsigned long long)histogram_percentile(total, samples, 0.999),
+         peak_rss());
+  fflush(stdout);
+
+  pthread_barrier_destroy(&run->barrier);
+  free(total);
+  free(contexts);
+  free(run);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-g] [-t max_threads] [-n ops] [-w workload]...\n"
+          "  -g, --glibc  run the workloads against glibc malloc as well\n"
+          "  -t  runs with 1, 2, 4... up to max_threads (default: CPUs)\n"
+          "  -n  operations per thread (default 1000000)\n"
+          "  -w  workload to run, all by default:\n",
+          name);
+  for (size_t i = 0; i < NUMBER_WORKLOADS; i++) {
+    fprintf(stderr, "        %-9s %s\n", workloads[i].name,
+            workloads[i].description);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  static const struct option options[] = {{"glibc", no_argument, NULL, 'g'},
+                                          {NULL, 0, NULL, 0}};
+  int glibc = 0;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = cpus < 1 ? 1 : (int)cpus;
+  size_t ops_per_thread = 1000000;
+  int selected[NUMBER_WORKLOADS] = {0};
+  int any_selected = 0;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "gt:n:w:", options, NULL)) != -1) {
+    switch (opt) {
+    case 'g':
+      glibc = 1;
+      break;
+    case 't':
+      max_threads = atoi(optarg);
+      break;
+    case 'n':
+      ops_per_thread = strtoull(optarg, NULL, 10);
+      break;
+    case 'w': {
+      size_t i = 0;
+      while (i < NUMBER_WORKLOADS && strcmp(workloads[i].name, optarg) != 0)
+        i++;
+      if (i == NUMBER_WORKLOADS) {
+        usage(argv[0]);
+        return 1;
+      }
+      selected[i] = any_selected = 1;
+      break;
+    }
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (max_threads < 1 || max_threads > MAX_THREADS) {
+    fprintf(stderr, "ERROR: max_threads must be between 1 and %d\n",
+            MAX_THREADS);
+    return 1;
+  }
+  /* Tracing every operation would measure the log, not the allocator */
+  my_malloc_set_logging(0);
+
+  printf("%-9s %-9s %3s %12s %8s %8s %8s %10s\n", "allocator", "workload",
+         "thr", "ops/s", "p50 ns", "p99 ns", "p999 ns", "peak KiB");
+  for (size_t w = 0; w < NUMBER_WORKLOADS; w++) {
+    if (any_selected && !selected[w])
+      continue;
+    for (int threads = 1;; threads = threads * 2 < max_threads
+                                          ? threads * 2
+                                          : max_threads) {
+      for (int a = 0; a < (glibc ? 2 : 1); a++) {
+        run_workload(allocators + a, workloads + w, threads, ops_per_thread);
+        if (allocators[a].malloc == my_malloc)
+          my_cleanup();
+      }
+      if (threads == max_threads)
+        break;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,110 @@
+#include "chunk_pool.h"
+#include "mymalloc_internal.h"
+#include "page_alloc.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* A slot holds the page number of a chunk above POOL_SIZE_BITS and its
+   size in pages below, 0 when empty. Chunks are claimed by compare and
+   swap on the slot, so they are never touched while in the pool */
+#define POOL_SIZE_BITS 16
+#define POOL_CLASSES (POOL_SIZE_BITS - 1)
+
+static _Atomic uint64_t pool_slots[POOL_CLASSES][POOL_SLOTS];
+static _Atomic size_t pool_bytes = 0;
+static size_t pool_max_bytes = POOL_MAX_BYTES;
+
+/* Chunks of 2^c to 2^(c+1) - 1 pages go to class c */
+static int pool_class(size_t pages) {
+  return (int)(sizeof(unsigned long long) * 8 - 1) - __builtin_clzll(pages);
+}
+
+static void *slot_chunk(uint64_t slot) {
+  return (void *)(uintptr_t)((slot >> POOL_SIZE_BITS) << PAGE_SHIFT);
+}
+
+static size_t slot_size(uint64_t slot) {
+  return (size_t)(slot & ((1 << POOL_SIZE_BITS) - 1)) << PAGE_SHIFT;
+}
+
+void chunk_pool_init(size_t max_bytes, size_t warm_bytes) {
+  pool_max_bytes = max_bytes;
+  for (size_t warm = 0; warm + CHUNK_ALIGN <= warm_bytes;
+       warm += CHUNK_ALIGN) {
+    char *chunk = (char *)page_alloc_aligned(CHUNK_ALIGN, CHUNK_ALIGN,
+                                             PAGE_HUGE_OFF);
+    if (chunk == NULL)
+      return;
+    for (size_t offset = 0; offset < CHUNK_ALIGN; offset += PAGE_DIV) {
+      ((volatile char *)chunk)[offset] = 0;
+    }
+    chunk_pool_put(chunk, CHUNK_ALIGN);
+  }
+}
+
+void chunk_pool_put(void *chunk, size_t size) {
+  size_t pages = size >> PAGE_SHIFT;
+  if (pages > 0 && size <= POOL_MAX_CHUNK_SIZE) {
+    size_t held =
+        atomic_fetch_add_explicit(&pool_bytes, size, memory_order_relaxed) +
+        size;
+    uint64_t slot =
+        (uint64_t)((size_t)chunk >> PAGE_SHIFT) << POOL_SIZE_BITS | pages;
+    int c = pool_class(pages);
+    for (int i = 0; held <= pool_max_bytes && i < POOL_SLOTS; i++) {
+      uint64_t empty = 0;
+      if (atomic_compare_exchange_strong_explicit(&pool_slots[c][i], &empty,
+                                                  slot, memory_order_release,
+                                                  memory_order_relaxed))
+        return;
+    }
+    atomic_fetch_sub_explicit(&pool_bytes, size, memory_order_relaxed);
+  }
+  if (!page_free(chunk, size)) {
+    fprintf(stderr, "ERROR: Cannot free page at %p of size %zd\n", chunk,
+            size);
+  }
+}
+
+void *chunk_pool_get(size_t size, size_t alignment) {
+  size_t pages = size >> PAGE_SHIFT;
+  if (atomic_load_explicit(&pool_bytes, memory_order_relaxed) < size ||
+      pages == 0 || size > POOL_MAX_CHUNK_SIZE)
+    return NULL;
+  /* Smaller classes first, so that large chunks are split last */
+  for (int c = pool_class(pages); c < POOL_CLASSES; c++) {
+    for (int i = 0; i < POOL_SLOTS; i++) {
+      uint64_t slot =
+          atomic_load_explicit(&pool_slots[c][i], memory_order_relaxed);
+      if (slot == 0 || slot_size(slot) < size ||
+          ((size_t)slot_chunk(slot) & (alignment - 1)) != 0)
+        continue;
+      if (atomic_compare_exchange_strong_explicit(&pool_slots[c][i], &slot, 0,
+                                                  memory_order_acquire,
+                                                  memory_order_relaxed)) {
+        atomic_fetch_sub_explicit(&pool_bytes, slot_size(slot),
+                                  memory_order_relaxed);
+        char *chunk = (char *)slot_chunk(slot);
+        if (slot_size(slot) > size)
+          chunk_pool_put(chunk + size, slot_size(slot) - size);
+        return chunk;
+      }
+    }
+  }
+  return NULL;
+}
+
+void chunk_pool_release() {
+  for (int c = 0; c < POOL_CLASSES; c++) {
+    for (int i = 0; i < POOL_SLOTS; i++) {
+      uint64_t slot = atomic_exchange(&pool_slots[c][i], 0);
+      if (slot != 0) {
+        atomic_fetch_sub(&pool_bytes, slot_size(slot));
+        page_free(slot_chunk(slot), slot_size(slot));
+      }
+    }
+  }
+}
+
+size_t chunk_pool_bytes() { return pool_bytes; }
@@ -0,0 +1,24 @@
+#ifndef CHUNK_POOL_HEADER
+#define CHUNK_POOL_HEADER
+#include <stddef.h>
+
+/** @brief Set how many bytes the pool may hold, and fill it with
+    warm_bytes of chunks whose pages are already faulted in */
+void chunk_pool_init(size_t max_bytes, size_t warm_bytes);
+
+/** @brief Take size bytes, a multiple of the page size, aligned to
+    alignment, NULL if the pool has no chunk that large. What is left of a
+    larger chunk stays in the pool. The contents are undefined */
+void *chunk_pool_get(size_t size, size_t alignment);
+
+/** @brief Give a chunk from page_alloc to the pool, which unmaps it when
+    it is full. size is a multiple of the page size */
+void chunk_pool_put(void *chunk, size_t size);
+
+/** @brief Unmap every chunk of the pool */
+void chunk_pool_release();
+
+/** @brief Bytes held by the pool */
+size_t chunk_pool_bytes();
+
+#endif /*CHUNK_POOL_HEADER*/
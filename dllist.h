@@ -11,7 +11,7 @@ typedef struct DLLElement_ {
   size_t size;
   int8_t flags;
   int16_t heap_index;
-  struct DLLElement_ *previous_in_mem;
+  size_t previous_footer;
   struct DLLElement_ *next, *previous;
 } DLLElement;
 
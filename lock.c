@@ -0,0 +1,31 @@
+#include "lock.h"
+
+#if !defined(MYMALLOC_NO_THREADING) && defined(__linux__) &&                  \
+    !defined(MYMALLOC_PTHREAD_LOCK)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* The lock is held: spin while it stays held without waiters, the holder
+   is likely done soon, then mark it contended and sleep until it is
+   handed over */
+void futex_lock_wait(Lock *lock) {
+  for (int i = 0; i < LOCK_SPIN_TRIES; i++) {
+    uint32_t state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    if (state == 0 && futex_lock_try(lock) == 0)
+      return;
+    if (state == 2)
+      break;
+    cpu_relax();
+  }
+  while (atomic_exchange_explicit(&lock->state, 2, memory_order_acquire) !=
+         0) {
+    atomic_fetch_add_explicit(&lock->sleeps, 1, memory_order_relaxed);
+    syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+  }
+}
+
+void futex_lock_wake(Lock *lock) {
+  syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#endif
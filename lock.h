@@ -1,5 +1,13 @@
 #ifndef MY_LOCK_HEADER
 #define MY_LOCK_HEADER
+#include <stdint.h>
+
+/* Eases a busy-wait loop on the CPU and its sibling hyperthread */
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
 
 #ifdef MYMALLOC_NO_THREADING
 
@@ -9,12 +17,59 @@ typedef int Lock;
 
 #define lock_init(lock)
 
-#define lock_acquire(lock)
+#define lock_acquire(lock) ((void)(lock))
 
-#define lock_release(lock)
+#define lock_release(lock) ((void)(lock))
 
 #define lock_try_acquire(lock) 0
 
+#define lock_sleeps(lock) ((uint64_t)0)
+
+#elif defined(__linux__) && !defined(MYMALLOC_PTHREAD_LOCK)
+#include <stdatomic.h>
+
+/* Spins on a held lock before sleeping on its futex */
+#define LOCK_SPIN_TRIES 100
+
+/* state is 0 when free, 1 when held and 2 when held with threads asleep
+   on it. sleeps counts how often a thread went to sleep, which only
+   happens off the fast path */
+typedef struct {
+  _Atomic uint32_t state;
+  _Atomic uint64_t sleeps;
+} Lock;
+
+#define LOCK_INITIALIZER {0, 0}
+
+void futex_lock_wait(Lock *lock);
+void futex_lock_wake(Lock *lock);
+
+/* Returns 0 when it took the lock, like pthread_mutex_trylock */
+static inline int futex_lock_try(Lock *lock) {
+  uint32_t expected = 0;
+  return !atomic_compare_exchange_strong_explicit(
+      &lock->state, &expected, 1, memory_order_acquire, memory_order_relaxed);
+}
+
+static inline void futex_lock_acquire(Lock *lock) {
+  if (futex_lock_try(lock) != 0)
+    futex_lock_wait(lock);
+}
+
+static inline void futex_lock_release(Lock *lock) {
+  if (atomic_exchange_explicit(&lock->state, 0, memory_order_release) == 2)
+    futex_lock_wake(lock);
+}
+
+#define lock_acquire(lock) (futex_lock_acquire(&(lock)))
+
+#define lock_release(lock) (futex_lock_release(&(lock)))
+
+#define lock_try_acquire(lock) (futex_lock_try(&(lock)))
+
+#define lock_sleeps(lock)                                                      \
+  (atomic_load_explicit(&(lock).sleeps, memory_order_relaxed))
+
 #else
 #include <pthread.h>
 
@@ -28,6 +83,8 @@ typedef pthread_mutex_t Lock;
 
 #define lock_try_acquire(lock) (pthread_mutex_trylock(&lock))
 
+#define lock_sleeps(lock) ((uint64_t)0)
+
 #endif
 
-#endif /*MY_LOCK_HEADER*/
\ No newline at end of file
+#endif /*MY_LOCK_HEADER*/
@@ -1,19 +1,224 @@
+#include "alloc_log.h"
+#include "log_trace.h"
 #include "mymalloc_internal.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-int main() {
-  FILE *flog;
-  void *pointer;
-  size_t size;
-  if ((flog = fopen(LOG_FILE, "r")) != NULL) {
-    while (!feof(flog)) {
-      if (fscanf(flog,
-                 "[%*s %*d %*d][%*d:%*d] malloc'd %zu %*s at address %p%*c",
-                 &size, &pointer) == 2) {
-        printf("%p %zu byte%s\n", pointer, size, size <= 1 ? "" : "s");
-      }
+#define HISTOGRAM_BUCKETS 64
+#define MAX_LEAKS_SHOWN 20
+
+typedef struct {
+  int64_t *deltas;
+  size_t count;
+  uint64_t start_ns;
+  uint64_t interval_ns;
+} Timeline;
+
+static void timeline_add(Timeline *timeline, uint64_t time_ns, int64_t delta) {
+  if (timeline->count == 0) {
+    timeline->start_ns = time_ns;
+  }
+  size_t bucket = time_ns > timeline->start_ns
+                      ? (time_ns - timeline->start_ns) / timeline->interval_ns
+                      : 0;
+  if (bucket >= timeline->count) {
+    size_t count = timeline->count ? timeline->count : 64;
+    while (count <= bucket)
+      count *= 2;
+    timeline->deltas =
+        (int64_t *)realloc(timeline->deltas, count * sizeof(int64_t));
+    if (timeline->deltas == NULL) {
+      fprintf(stderr, "ERROR: out of memory for timeline\n");
+      exit(1);
     }
-    fclose(flog);
+    memset(timeline->deltas + timeline->count, 0,
+           (count - timeline->count) * sizeof(int64_t));
+    timeline->count = count;
+  }
+  timeline->deltas[bucket] += delta;
+}
+
+/* Records are taken in the order they happened in, so every free comes
+   after the malloc it matches. Processes have address spaces of their
+   own, a forked child's frees do not match its parent's mallocs */
+static void on_malloc(AddressTable *table, Timeline *timeline,
+                      const LogRecord *record) {
+  uint32_t process = LOG_PROCESS_OF(record->thread_id);
+  TraceEntry *entry = table_find(table, process, record->address);
+  if (entry != NULL) {
+    /* The trace lost the free of the previous block at this address */
+    timeline_add(timeline, record->time_ns, -(int64_t)entry->size);
+  } else {
+    entry = table_insert(table, process, record->address);
+  }
+  entry->size = record->size;
+  entry->time_ns = record->time_ns;
+  entry->thread_id = record->thread_id;
+  timeline_add(timeline, record->time_ns, (int64_t)record->size);
+}
+
+/* Returns 0 for a free without a malloc */
+static int on_free(AddressTable *table, Timeline *timeline, uint64_t address,
+                   const LogRecord *record) {
+  TraceEntry *entry =
+      table_find(table, LOG_PROCESS_OF(record->thread_id), address);
+  if (entry == NULL)
+    return 0;
+  timeline_add(timeline, record->time_ns, -(int64_t)entry->size);
+  table_remove(table, entry);
+  return 1;
+}
+
+static const char *op_name(uint8_t op) {
+  switch (op) {
+  case LOG_OP_MALLOC:
+    return "malloc";
+  case LOG_OP_FREE:
+    return "free";
+  case LOG_OP_REALLOC:
+    return "realloc";
+  default:
+    return "?";
   }
-}
\ No newline at end of file
+}
+
+static void print_record(const LogRecord *record) {
+  printf("#%llu %llu.%09llu thread %u.%u heap %d %s %p",
+         (unsigned long long)record->sequence,
+         (unsigned long long)(record->time_ns / 1000000000),
+         (unsigned long long)(record->time_ns % 1000000000),
+         LOG_PROCESS_OF(record->thread_id),
+         record->thread_id & ((1u << LOG_THREAD_BITS) - 1),
+         record->heap_index, op_name(record->op),
+         (void *)(uintptr_t)record->address);
+  if (record->op == LOG_OP_REALLOC)
+    printf(" from %p", (void *)(uintptr_t)record->old_address);
+  if (record->op != LOG_OP_FREE)
+    printf(" %llu bytes", (unsigned long long)record->size);
+  printf("\n");
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-p] [-i interval_ms] [file]\n"
+          "  -p  print every record\n"
+          "  -i  live bytes sampling interval (default 1000 ms)\n"
+          "  file defaults to " LOG_FILE "\n",
+          name);
+}
+
+int main(int argc, char *argv[]) {
+  const char *path = LOG_FILE;
+  int print_records = 0;
+  uint64_t interval_ms = 1000;
+  int opt;
+  while ((opt = getopt(argc, argv, "pi:")) != -1) {
+    switch (opt) {
+    case 'p':
+      print_records = 1;
+      break;
+    case 'i':
+      interval_ms = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind < argc)
+    path = argv[optind];
+  if (interval_ms == 0)
+    interval_ms = 1;
+
+  Trace trace;
+  if (!trace_open(&trace, path))
+    return 1;
+
+  AddressTable table;
+  table_init(&table);
+  Timeline timeline = {NULL, 0, 0, interval_ms * 1000000};
+  uint64_t histogram[HISTOGRAM_BUCKETS] = {0};
+  uint64_t op_counts[4] = {0};
+  uint64_t unmatched_frees = 0;
+
+  TraceCursor cursor;
+  trace_cursor_init(&cursor, &trace);
+  const LogRecord *record;
+  while ((record = trace_cursor_next(&cursor)) != NULL) {
+    op_counts[record->op]++;
+    if (print_records)
+      print_record(record);
+    if (record->op == LOG_OP_FREE) {
+      if (!on_free(&table, &timeline, record->address, record))
+        unmatched_frees++;
+      continue;
+    }
+    if (record->op == LOG_OP_REALLOC && record->old_address != 0 &&
+        !on_free(&table, &timeline, record->old_address, record))
+      unmatched_frees++;
+    on_malloc(&table, &timeline, record);
+    int bucket = record->size ? 64 - __builtin_clzll(record->size) : 0;
+    histogram[bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1]++;
+  }
+
+  printf("%llu malloc, %llu free, %llu realloc\n",
+         (unsigned long long)op_counts[LOG_OP_MALLOC],
+         (unsigned long long)op_counts[LOG_OP_FREE],
+         (unsigned long long)op_counts[LOG_OP_REALLOC]);
+  if (unmatched_frees != 0)
+    printf("%llu frees without a malloc\n",
+           (unsigned long long)unmatched_frees);
+
+  printf("\nLive bytes every %llu ms:\n", (unsigned long long)interval_ms);
+  int64_t live = 0;
+  size_t last_bucket = 0;
+  for (size_t i = 0; i < timeline.count; i++) {
+    if (timeline.deltas[i] != 0)
+      last_bucket = i;
+  }
+  for (size_t i = 0; i < timeline.count && i <= last_bucket; i++) {
+    live += timeline.deltas[i];
+    printf("  +%llu ms %lld\n", (unsigned long long)(i * interval_ms),
+           (long long)live);
+  }
+
+  printf("\nSize histogram:\n");
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    if (histogram[i] != 0) {
+      printf("  < %-20llu %llu\n",
+             (unsigned long long)(i < 64 ? (1ULL << i) : 0),
+             (unsigned long long)histogram[i]);
+    }
+  }
+
+  size_t leaks = 0;
+  uint64_t leaked_bytes = 0;
+  for (size_t i = 0; i < table.capacity; i++) {
+    TraceEntry *entry = table.entries + i;
+    if (entry->address == 0)
+      continue;
+    if (leaks < MAX_LEAKS_SHOWN) {
+      if (leaks == 0)
+        printf("\nLeak candidates (malloc without free):\n");
+      printf("  %p %llu bytes thread %u.%u at %llu.%09llu\n",
+             (void *)(uintptr_t)entry->address,
+             (unsigned long long)entry->size,
+             LOG_PROCESS_OF(entry->thread_id),
+             entry->thread_id & ((1u << LOG_THREAD_BITS) - 1),
+             (unsigned long long)(entry->time_ns / 1000000000),
+             (unsigned long long)(entry->time_ns % 1000000000));
+    }
+    leaks++;
+    leaked_bytes += entry->size;
+  }
+  printf("\n%zu leak candidate%s, %llu bytes\n", leaks, leaks == 1 ? "" : "s",
+         (unsigned long long)leaked_bytes);
+
+  trace_cursor_free(&cursor);
+  table_free(&table);
+  free(timeline.deltas);
+  trace_close(&trace);
+  return 0;
+}
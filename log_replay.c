@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+#include "alloc_log.h"
+#include "log_trace.h"
+#include "mymalloc.h"
+#include "mymalloc_internal.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Allocator counters are sampled every REPLAY_SAMPLE_EVERY operations */
+#define REPLAY_SAMPLE_EVERY 256
+
+typedef struct {
+  uint64_t address;
+  uint64_t old_address;
+  uint64_t size;
+  uint32_t thread;
+  uint8_t op;
+} Operation;
+
+typedef struct {
+  sem_t turn;
+  size_t remaining;
+  int started;
+  pthread_t handle;
+} ReplayThread;
+
+typedef struct {
+  uint64_t operations;
+  uint64_t allocator_ns;
+  uint64_t unmatched_frees;
+  uint64_t reused_addresses;
+  size_t peak_mapped;
+  double peak_fragmentation;
+} ReplayResult;
+
+/* The trace of every process, sorted by process then by sequence */
+static Operation *trace;
+static size_t trace_length;
+/* The process being replayed */
+static Operation *operations;
+static size_t operation_count;
+static size_t position;
+static ReplayThread *threads;
+/* Threads past their last operation, not joined yet */
+static size_t *retired;
+static size_t retired_count;
+/* Posted by the thread that replays the last operation */
+static sem_t finished;
+/* Trace address to the memory that stands for it in the replay. Processes
+   are replayed one after the other, so all of them use process 0 */
+static AddressTable address_map;
+static ReplayResult result;
+
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static void map_insert(uint64_t address, void *pointer) {
+  TraceEntry *entry = table_find(&address_map, 0, address);
+  if (entry != NULL) {
+    /* The trace lost the free of the previous block at this address */
+    result.reused_addresses++;
+    my_free(entry->pointer);
+  } else {
+    entry = table_insert(&address_map, 0, address);
+  }
+  entry->pointer = pointer;
+}
+
+static void touch(void *pointer, uint64_t size) {
+  if (pointer != NULL && size > 0)
+    *(volatile char *)pointer = 1;
+}
+
+static void replay_operation(const Operation *operation) {
+  TraceEntry *entry;
+  void *pointer = NULL;
+  uint64_t start;
+  switch (operation->op) {
+  case LOG_OP_MALLOC:
+    start = now_ns();
+    pointer = my_malloc(operation->size);
+    result.allocator_ns += now_ns() - start;
+    touch(pointer, operation->size);
+    map_insert(operation->address, pointer);
+    break;
+  case LOG_OP_FREE:
+    entry = table_find(&address_map, 0, operation->address);
+    if (entry == NULL) {
+      result.unmatched_frees++;
+      break;
+    }
+    pointer = entry->pointer;
+    table_remove(&address_map, entry);
+    start = now_ns();
+    my_free(pointer);
+    result.allocator_ns += now_ns() - start;
+    break;
+  case LOG_OP_REALLOC:
+    if (operation->old_address != 0) {
+      entry = table_find(&address_map, 0, operation->old_address);
+      if (entry != NULL) {
+        pointer = entry->pointer;
+        table_remove(&address_map, entry);
+      }
+    }
+    start = now_ns();
+    pointer = my_realloc(pointer, operation->size);
+    result.allocator_ns += now_ns() - start;
+    touch(pointer, operation->size);
+    map_insert(operation->address, pointer);
+    break;
+  }
+}
+
+static void sample_counters() {
+  MyMallocStats stats;
+  my_malloc_stats(&stats, NULL, 0);
+  size_t mapped = stats.total.mapped_bytes + stats.large_mapped_bytes;
+  if (mapped > result.peak_mapped) {
+    result.peak_mapped = mapped;
+    result.peak_fragmentation = stats.total.fragmentation;
+  }
+}
+
+static void join_retired() {
+  while (retired_count > 0) {
+    pthread_join(threads[retired[--retired_count]].handle, NULL);
+  }
+}
+
+static void *replay_thread(void *args);
+
+/* Threads start at their first operation, so only the trace threads that
+   overlap run at once. Retired threads are joined first, to keep a
+   churning trace from piling up exited ones */
+static void start_thread(size_t index) {
+  join_retired();
+  threads[index].started = 1;
+  if (pthread_create(&threads[index].handle, NULL, replay_thread,
+                     threads + index) != 0) {
+    fprintf(stderr, "ERROR: cannot start replay thread %zu\n", index);
+    exit(1);
+  }
+}
+
+/* Operations run one at a time in trace order. The thread that ran one
+   hands the turn to the owner of the next, so every trace thread is
+   replayed by a thread of its own, with the original interleaving. A
+   thread exits after its last operation, as its trace thread did. Only
+   the holder of the turn touches the shared state */
+static void *replay_thread(void *args) {
+  ReplayThread *self = (ReplayThread *)args;
+  for (;;) {
+    sem_wait(&self->turn);
+    const Operation *operation;
+    do {
+      operation = operations + position;
+      replay_operation(operation);
+      if (++position % REPLAY_SAMPLE_EVERY == 0)
+        sample_counters();
+      self->remaining--;
+    } while (position < operation_count &&
+             operations[position].thread == operation->thread);
+    int last = self->remaining == 0;
+    ReplayThread *next = NULL;
+    if (position < operation_count) {
+      next = threads + operations[position].thread;
+      if (!next->started)
+        start_thread((size_t)(next - threads));
+    }
+    if (last)
+      retired[retired_count++] = (size_t)(self - threads);
+    if (next != NULL)
+      sem_post(&next->turn);
+    else
+      sem_post(&finished);
+    if (last)
+      return NULL;
+  }
+}
+
+/* Copies the written records of the trace into trace, by process then by
+   sequence. Processes own disjoint address spaces, so a forked child may
+   free at the same address as its parent. Each process is replayed on its
+   own */
+static void load_trace(const Trace *file) {
+  trace = (Operation *)malloc((size_t)(file->last - file->first) *
+                              sizeof(Operation));
+  if (trace == NULL) {
+    fprintf(stderr, "ERROR: out of memory for the trace\n");
+    exit(1);
+  }
+  TraceCursor cursor;
+  trace_cursor_init(&cursor, file);
+  const LogRecord *record;
+  while ((record = trace_cursor_next(&cursor)) != NULL) {
+    Operation *operation = trace + trace_length++;
+    operation->address = record->address;
+    operation->old_address = record->old_address;
+    operation->size = record->size;
+    operation->thread = record->thread_id;
+    operation->op = record->op;
+  }
+  trace_cursor_free(&cursor);
+}
+
+/* Renumbers the threads of the process in operations from 0 */
+static size_t number_threads() {
+  uint32_t *renumbered =
+      (uint32_t *)calloc((size_t)1 << LOG_THREAD_BITS, sizeof(uint32_t));
+  uint32_t thread_count = 0;
+  for (size_t i = 0; i < operation_count; i++) {
+    uint32_t *slot =
+        renumbered + (operations[i].thread & ((1u << LOG_THREAD_BITS) - 1));
+    if (*slot == 0)
+      *slot = ++thread_count;
+    operations[i].thread = *slot - 1;
+  }
+  free(renumbered);
+  return thread_count;
+}
+
+/* Replays operations with one thread per trace thread, then releases the
+   memory the process still held */
+static void replay_process(size_t thread_count) {
+  position = 0;
+  threads = (ReplayThread *)calloc(thread_count, sizeof(ReplayThread));
+  retired = (size_t *)malloc(thread_count * sizeof(size_t));
+  if (threads == NULL || retired == NULL) {
+    fprintf(stderr, "ERROR: out of memory for %zu threads\n", thread_count);
+    exit(1);
+  }
+  for (size_t i = 0; i < operation_count; i++) {
+    threads[operations[i].thread].remaining++;
+  }
+  for (size_t i = 0; i < thread_count; i++) {
+    sem_init(&threads[i].turn, 0, 0);
+  }
+  sem_init(&finished, 0, 0);
+  start_thread(operations[0].thread);
+  sem_post(&threads[operations[0].thread].turn);
+  sem_wait(&finished);
+  join_retired();
+  for (size_t i = 0; i < thread_count; i++) {
+    sem_destroy(&threads[i].turn);
+  }
+  sem_destroy(&finished);
+  free(retired);
+  free(threads);
+  sample_counters();
+  for (size_t i = 0; i < address_map.capacity; i++) {
+    if (address_map.entries[i].address != 0)
+      my_free(address_map.entries[i].pointer);
+  }
+  table_clear(&address_map);
+}
+
+int main(int argc, char *argv[]) {
+  const char *path = argc > 1 ? argv[1] : LOG_FILE;
+  if (argc > 2 || (argc > 1 && argv[1][0] == '-')) {
+    fprintf(stderr,
+            "Usage: %s [file]\n"
+            "  file defaults to " LOG_FILE "\n",
+            argv[0]);
+    return 1;
+  }
+  Trace file;
+  if (!trace_open(&file, path))
+    return 1;
+
+  /* The replay must not append to the trace it reads */
+  my_malloc_set_logging(0);
+  load_trace(&file);
+  trace_close(&file);
+  if (trace_length == 0) {
+    printf("Nothing to replay\n");
+    return 0;
+  }
+
+  table_init(&address_map);
+  size_t process_count = 0;
+  size_t total_threads = 0;
+  uint64_t elapsed = 0;
+  for (size_t first = 0; first < trace_length; first += operation_count) {
+    uint32_t process = LOG_PROCESS_OF(trace[first].thread);
+    operations = trace + first;
+    operation_count = 0;
+    while (first + operation_count < trace_length &&
+           LOG_PROCESS_OF(operations[operation_count].thread) == process) {
+      operation_count++;
+    }
+    size_t thread_count = number_threads();
+    uint64_t start = now_ns();
+    replay_process(thread_count);
+    elapsed += now_ns() - start;
+    process_count++;
+    total_threads += thread_count;
+  }
+
+  printf("%zu operations from %zu threads in %zu processes\n", trace_length,
+         total_threads, process_count);
+  printf("wall time       %.3f ms\n", (double)elapsed / 1e6);
+  printf("allocator time  %.3f ms (%.1f ns per operation)\n",
+         (double)result.allocator_ns / 1e6,
+         (double)result.allocator_ns / (double)trace_length);
+  printf("peak mapped     %zu bytes, fragmentation %.3f\n", result.peak_mapped,
+         result.peak_fragmentation);
+  if (result.unmatched_frees != 0 || result.reused_addresses != 0) {
+    printf("%llu frees without a malloc, %llu addresses reused without a "
+           "free\n",
+           (unsigned long long)result.unmatched_frees,
+           (unsigned long long)result.reused_addresses);
+  }
+  return 0;
+}
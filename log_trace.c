@@ -0,0 +1,223 @@
+#include "log_trace.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int trace_open(Trace *trace, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return 0;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(LogFileHeader)) {
+    fprintf(stderr, "ERROR: %s is not an allocation trace\n", path);
+    close(fd);
+    return 0;
+  }
+  const char *data = (const char *)mmap(NULL, (size_t)st.st_size, PROT_READ,
+                                        MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return 0;
+  }
+  const LogFileHeader *header = (const LogFileHeader *)data;
+  if (memcmp(header->magic, LOG_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != LOG_VERSION ||
+      header->record_size != sizeof(LogRecord)) {
+    fprintf(stderr, "ERROR: %s has an unknown format\n", path);
+    munmap((void *)data, (size_t)st.st_size);
+    return 0;
+  }
+  uint64_t end = header->end;
+  if (end > (uint64_t)st.st_size)
+    end = (uint64_t)st.st_size;
+  trace->data = data;
+  trace->size = (size_t)st.st_size;
+  trace->first = (const LogRecord *)(data + sizeof(LogFileHeader));
+  trace->last = trace->first + (end - sizeof(LogFileHeader)) / sizeof(LogRecord);
+  return 1;
+}
+
+void trace_close(Trace *trace) {
+  munmap((void *)trace->data, trace->size);
+  trace->data = NULL;
+}
+
+static int record_before(const LogRecord *left, const LogRecord *right) {
+  uint32_t left_process = LOG_PROCESS_OF(left->thread_id);
+  uint32_t right_process = LOG_PROCESS_OF(right->thread_id);
+  if (left_process != right_process)
+    return left_process < right_process;
+  return left->sequence < right->sequence;
+}
+
+static int record_written(const LogRecord *record) {
+  return record->op >= LOG_OP_MALLOC && record->op <= LOG_OP_REALLOC;
+}
+
+static void cursor_sift_down(TraceCursor *cursor, size_t i) {
+  TraceRun *runs = cursor->runs;
+  for (;;) {
+    size_t least = i;
+    size_t left = 2 * i + 1;
+    size_t right = left + 1;
+    if (left < cursor->count &&
+        record_before(runs[left].next, runs[least].next))
+      least = left;
+    if (right < cursor->count &&
+        record_before(runs[right].next, runs[least].next))
+      least = right;
+    if (least == i)
+      return;
+    TraceRun run = runs[i];
+    runs[i] = runs[least];
+    runs[least] = run;
+    i = least;
+  }
+}
+
+static void cursor_add_run(TraceCursor *cursor, size_t *capacity,
+                           const LogRecord *start, const LogRecord *end) {
+  if (start == end)
+    return;
+  if (cursor->count == *capacity) {
+    *capacity = *capacity ? 2 * *capacity : 64;
+    cursor->runs =
+        (TraceRun *)realloc(cursor->runs, *capacity * sizeof(TraceRun));
+    if (cursor->runs == NULL) {
+      fprintf(stderr, "ERROR: out of memory for the runs of the trace\n");
+      exit(1);
+    }
+  }
+  cursor->runs[cursor->count++] = (TraceRun){start, end};
+}
+
+/* Records never written end a run, so that runs hold written ones only */
+void trace_cursor_init(TraceCursor *cursor, const Trace *trace) {
+  size_t capacity = 0;
+  *cursor = (TraceCursor){NULL, 0};
+  const LogRecord *start = trace->first;
+  for (const LogRecord *record = trace->first; record < trace->last;
+       record++) {
+    if (!record_written(record)) {
+      cursor_add_run(cursor, &capacity, start, record);
+      start = record + 1;
+    } else if (record > start && record_before(record, record - 1)) {
+      cursor_add_run(cursor, &capacity, start, record);
+      start = record;
+    }
+  }
+  cursor_add_run(cursor, &capacity, start, trace->last);
+  for (size_t i = cursor->count / 2; i-- > 0;) {
+    cursor_sift_down(cursor, i);
+  }
+}
+
+const LogRecord *trace_cursor_next(TraceCursor *cursor) {
+  if (cursor->count == 0)
+    return NULL;
+  TraceRun *first = cursor->runs;
+  const LogRecord *record = first->next++;
+  if (first->next == first->end)
+    *first = cursor->runs[--cursor->count];
+  cursor_sift_down(cursor, 0);
+  return record;
+}
+
+void trace_cursor_free(TraceCursor *cursor) {
+  free(cursor->runs);
+  cursor->runs = NULL;
+  cursor->count = 0;
+}
+
+static size_t hash_address(uint32_t process, uint64_t address,
+                           size_t capacity) {
+  address ^= (uint64_t)process << 48;
+  address ^= address >> 33;
+  address *= 0xff51afd7ed558ccdULL;
+  address ^= address >> 33;
+  return (size_t)address & (capacity - 1);
+}
+
+static void table_grow(AddressTable *table) {
+  AddressTable grown = {NULL, table->capacity ? 2 * table->capacity : 1024, 0};
+  grown.entries = (TraceEntry *)calloc(grown.capacity, sizeof(TraceEntry));
+  if (grown.entries == NULL) {
+    fprintf(stderr, "ERROR: out of memory for %zu addresses\n", table->count);
+    exit(1);
+  }
+  for (size_t i = 0; i < table->capacity; i++) {
+    TraceEntry *entry = table->entries + i;
+    if (entry->address != 0)
+      *table_insert(&grown, entry->process, entry->address) = *entry;
+  }
+  free(table->entries);
+  *table = grown;
+}
+
+void table_init(AddressTable *table) {
+  *table = (AddressTable){NULL, 0, 0};
+  table_grow(table);
+}
+
+TraceEntry *table_find(AddressTable *table, uint32_t process,
+                       uint64_t address) {
+  size_t i = hash_address(process, address, table->capacity);
+  while (table->entries[i].address != 0) {
+    if (table->entries[i].address == address &&
+        table->entries[i].process == process)
+      return table->entries + i;
+    i = (i + 1) & (table->capacity - 1);
+  }
+  return NULL;
+}
+
+TraceEntry *table_insert(AddressTable *table, uint32_t process,
+                         uint64_t address) {
+  if (2 * (table->count + 1) > table->capacity)
+    table_grow(table);
+  size_t i = hash_address(process, address, table->capacity);
+  while (table->entries[i].address != 0) {
+    i = (i + 1) & (table->capacity - 1);
+  }
+  table->count++;
+  table->entries[i].address = address;
+  table->entries[i].process = process;
+  return table->entries + i;
+}
+
+/* Backward-shift deletion keeps probe sequences intact without tombstones */
+void table_remove(AddressTable *table, TraceEntry *entry) {
+  size_t mask = table->capacity - 1;
+  size_t hole = (size_t)(entry - table->entries);
+  size_t i = hole;
+  for (;;) {
+    i = (i + 1) & mask;
+    TraceEntry *next = table->entries + i;
+    if (next->address == 0)
+      break;
+    size_t home = hash_address(next->process, next->address, table->capacity);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      table->entries[hole] = *next;
+      hole = i;
+    }
+  }
+  table->entries[hole].address = 0;
+  table->count--;
+}
+
+void table_clear(AddressTable *table) {
+  memset(table->entries, 0, table->capacity * sizeof(TraceEntry));
+  table->count = 0;
+}
+
+void table_free(AddressTable *table) {
+  free(table->entries);
+  table->entries = NULL;
+}
@@ -0,0 +1,86 @@
+#ifndef LOG_TRACE_HEADER
+#define LOG_TRACE_HEADER
+#include <stddef.h>
+#include <stdint.h>
+
+#include "alloc_log.h"
+
+/* A trace file mapped for reading, shared by log_reader and log_replay */
+typedef struct {
+  const char *data;
+  size_t size;
+  /* The records written up to the header's end */
+  const LogRecord *first;
+  const LogRecord *last;
+} Trace;
+
+/* Records in a file run of increasing process and sequence */
+typedef struct {
+  const LogRecord *next;
+  const LogRecord *end;
+} TraceRun;
+
+/* Walks the records of a trace by process, then by sequence, the order
+   they happened in. Each drain of a thread's ring appends a run of
+   records in order, so the cursor merges the runs of the file */
+typedef struct {
+  /* A min-heap of the runs by their next record */
+  TraceRun *runs;
+  size_t count;
+} TraceCursor;
+
+/* What a tool keeps about an address of a process. address is 0 for an
+   empty slot */
+typedef struct {
+  uint64_t address;
+  uint64_t size;
+  uint64_t time_ns;
+  void *pointer;
+  uint32_t process;
+  uint32_t thread_id;
+} TraceEntry;
+
+/* Open-addressing table of TraceEntry by process and address */
+typedef struct {
+  TraceEntry *entries;
+  size_t capacity;
+  size_t count;
+} AddressTable;
+
+/** @brief Map a trace file and check its header, printing what went
+    wrong and returning 0 on failure */
+int trace_open(Trace *trace, const char *path);
+
+void trace_close(Trace *trace);
+
+/** @brief Start walking the written records of a trace in order, exits
+    when out of memory */
+void trace_cursor_init(TraceCursor *cursor, const Trace *trace);
+
+/** @brief The next record in order, NULL after the last one */
+const LogRecord *trace_cursor_next(TraceCursor *cursor);
+
+void trace_cursor_free(TraceCursor *cursor);
+
+/** @brief Allocate an empty table, exits when out of memory */
+void table_init(AddressTable *table);
+
+/** @brief The entry of address in process, NULL if it has none */
+TraceEntry *table_find(AddressTable *table, uint32_t process,
+                       uint64_t address);
+
+/** @brief Add an entry for address in process, which has none yet. The
+    other fields are left to the caller */
+TraceEntry *table_insert(AddressTable *table, uint32_t process,
+                         uint64_t address);
+
+/** @brief Remove an entry returned by table_find or table_insert. Other
+    entries may move */
+void table_remove(AddressTable *table, TraceEntry *entry);
+
+/** @brief Remove every entry */
+void table_clear(AddressTable *table);
+
+void table_free(AddressTable *table);
+
+#endif /*LOG_TRACE_HEADER*/
@@ -1,9 +1,19 @@
+#define _GNU_SOURCE
+#include "alloc_log.h"
+#include "chunk_pool.h"
 #include "dllist.h"
 #include "lock.h"
+#include "numa.h"
 #include "page_alloc.h"
+#include "pagemap.h"
+#include "slab.h"
+#include <pthread.h>
+#include <sched.h>
 #include <stdatomic.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -11,28 +21,196 @@
 #include "mymalloc_internal.h"
 
 #define HEAP_INITIALIZER                                                       \
-  { LIST_INITIALIZER, LIST_INITIALIZER, LOCK_INITIALIZER }
+  {                                                                            \
+    LIST_INITIALIZER, {LIST_INITIALIZER}, 0, 0, NULL, {NULL}, NULL, NULL,      \
+        NULL, NULL, NULL, CHUNK_MIN_SIZE, {0}, LOCK_INITIALIZER                \
+  }
 
-static Heap heaps[NUMBER_HEAPS];
+static Heap heaps[MAX_HEAPS];
+/* Heaps in use, starts at the number of CPUs and grows on contention */
+static _Atomic int16_t heap_count = 1;
 
 _Thread_local int16_t thread_index = -1;
-_Atomic int16_t global_thread_count = -1;
+/* Set once my_init is done */
+static atomic_int initialized = 0;
 Lock init_lock = LOCK_INITIALIZER;
 
-static inline size_t fit_to_memalign(size_t size) {
-  return (MEM_ALIGN * ((size + MEM_ALIGN - 1) / MEM_ALIGN));
+static _Thread_local ThreadCache tcache;
+static _Atomic unsigned heap_generation = 1;
+static size_t mmap_threshold = MMAP_THRESHOLD;
+static _Atomic size_t large_mapped_bytes = 0;
+static _Atomic size_t large_blocks = 0;
+static long purge_decay_ms = PURGE_DECAY_MS;
+static PageHugeMode huge_pages = PAGE_HUGE_OFF;
+/* Bounds of the heap region, both NULL when it could not be reserved */
+static char *heap_region_start = NULL;
+static char *heap_region_end = NULL;
+#ifndef MYMALLOC_NO_THREADING
+static pthread_key_t thread_key;
+static void thread_exit(void *unused);
+#endif
+
+static inline size_t fit_to_page(size_t size) {
+  return (PAGE_DIV * ((size + PAGE_DIV - 1) / PAGE_DIV));
+}
+
+static uint64_t now_ns() {
+  struct timespec now;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t precise_now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static void heap_schedule_purge(Heap *heap) {
+  if (purge_decay_ms >= 0 && heap->purge_deadline == 0)
+    heap->purge_deadline = now_ns() + (uint64_t)purge_decay_ms * 1000000;
+}
+
+static void heap_region_init() {
+  size_t size = (size_t)MAX_HEAPS * HEAP_SPAN;
+  /* One more CHUNK_ALIGN to align the start */
+  char *region = (char *)page_reserve(size + CHUNK_ALIGN);
+  if (region == NULL)
+    return;
+  heap_region_start =
+      (char *)(((size_t)region + CHUNK_ALIGN - 1) & ~(CHUNK_ALIGN - 1));
+  heap_region_end = heap_region_start + size;
+}
+
+static inline int is_in_heap_region(void *pointer) {
+  return (char *)pointer >= heap_region_start &&
+         (char *)pointer < heap_region_end;
+}
+
+static inline char *heap_span_start(int16_t heap_index) {
+  return heap_region_start + (size_t)heap_index * HEAP_SPAN;
 }
 
 void heap_init(int16_t heap_index) {
-  heaps[heap_index] = (Heap)HEAP_INITIALIZER;
+  Heap *heap = heaps + heap_index;
+  int32_t threads = heap->counters.threads;
+  *heap = (Heap)HEAP_INITIALIZER;
+  heap->counters.threads = threads;
+  slab_heap_init(heap, heap_index);
+  if (heap_region_start != NULL) {
+    heap->block_top = heap_span_start(heap_index);
+    heap->block_end = heap->block_top + HEAP_SPAN;
+  }
+}
+
+/* Decommits the heap's span, its chunk is not in the chunk list */
+static void heap_span_release(Heap *heap, int16_t heap_index) {
+  if (heap_region_start == NULL)
+    return;
+  char *start = heap_span_start(heap_index);
+  if (heap->block_top > start) {
+    pagemap_clear(start, (size_t)(heap->block_top - start));
+    page_decommit(start, (size_t)(heap->block_top - start));
+  }
 }
 
+/* Rounds heap_count up to a multiple of numa_nodes, so that every node
+   has as many heaps. Threads may use any heap below heap_count, so it
+   never goes down: NUMA placement stays off when rounding up would pass
+   MAX_HEAPS */
+static void numa_setup(int enabled, int fake_nodes) {
+  numa_configure(enabled, fake_nodes);
+  int16_t count = heap_count;
+  int rounded;
+  do {
+    rounded = (count + numa_nodes - 1) / numa_nodes * numa_nodes;
+    if (rounded > MAX_HEAPS) {
+      numa_configure(0, 0);
+      return;
+    }
+  } while (!atomic_compare_exchange_weak(&heap_count, &count,
+                                         (int16_t)rounded));
+}
+
+#ifndef MYMALLOC_NO_THREADING
+/* Nothing may hold an allocator lock across fork, or the child would
+   deadlock on it */
+static void fork_prepare() {
+  lock_acquire(init_lock);
+  for (int16_t i = 0; i < MAX_HEAPS; i++) {
+    lock_acquire(heaps[i].lock);
+  }
+  log_fork_prepare();
+}
+
+static void fork_parent() {
+  log_fork_parent();
+  for (int16_t i = MAX_HEAPS - 1; i >= 0; i--) {
+    lock_release(heaps[i].lock);
+  }
+  lock_release(init_lock);
+}
+
+/* Only the forking thread lives on in the child, the heaps the other
+   threads had are free to take. What their thread caches held is lost */
+static void fork_child() {
+  log_fork_child();
+  for (int16_t i = MAX_HEAPS - 1; i >= 0; i--) {
+    heaps[i].counters.threads = 0;
+    lock_release(heaps[i].lock);
+  }
+  if (thread_index != -1)
+    heaps[thread_index].counters.threads = 1;
+  lock_release(init_lock);
+}
+#endif
+
 void my_init() {
   lock_acquire(init_lock);
-  global_thread_count = 0;
-  for (int16_t i = 0; i < NUMBER_HEAPS; i++) {
+  if (initialized) {
+    /* Another thread got here first */
+    lock_release(init_lock);
+    return;
+  }
+#ifndef MYMALLOC_NO_THREADING
+  pthread_key_create(&thread_key, thread_exit);
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+#endif
+  const char *log_env = getenv("MYMALLOC_LOG");
+  if (log_env != NULL && log_env[0] == '0')
+    log_set_enabled(0);
+  const char *threshold_env = getenv("MYMALLOC_MMAP_THRESHOLD");
+  if (threshold_env != NULL)
+    mmap_threshold = strtoull(threshold_env, NULL, 10);
+  const char *decay_env = getenv("MYMALLOC_PURGE_DECAY_MS");
+  if (decay_env != NULL)
+    purge_decay_ms = strtol(decay_env, NULL, 10);
+  const char *huge_env = getenv("MYMALLOC_HUGE_PAGES");
+  if (huge_env != NULL)
+    my_malloc_set_huge_pages((MyHugePages)strtol(huge_env, NULL, 10));
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  heap_count = cpus < 1 ? 1 : (cpus > MAX_HEAPS ? MAX_HEAPS : (int16_t)cpus);
+  const char *numa_env = getenv("MYMALLOC_NUMA");
+  const char *numa_nodes_env = getenv("MYMALLOC_NUMA_NODES");
+  int fake_nodes =
+      numa_nodes_env != NULL ? (int)strtol(numa_nodes_env, NULL, 10) : 0;
+  if ((numa_env != NULL && numa_env[0] == '1') || fake_nodes > 0)
+    numa_setup(1, fake_nodes);
+  const char *pool_env = getenv("MYMALLOC_POOL_MAX");
+  const char *warm_env = getenv("MYMALLOC_POOL_WARM");
+  chunk_pool_init(pool_env != NULL ? strtoull(pool_env, NULL, 10)
+                                   : POOL_MAX_BYTES,
+                  warm_env != NULL ? strtoull(warm_env, NULL, 10) : 0);
+  slab_region_init();
+  heap_region_init();
+  for (int16_t i = 0; i < MAX_HEAPS; i++) {
     heap_init(i);
   }
+  initialized = 1;
   lock_release(init_lock);
 }
 
@@ -43,19 +221,73 @@ static char *get_start(BlockHeader *block) {
 void block_init(BlockHeader *block, size_t size) {
   block->size = size;
   block->flags = 0;
-  block->previous_in_mem = NULL;
 }
 
-void split_block(DLList *free_list, BlockHeader *block, size_t size) {
+static inline int floor_log2(size_t size) {
+  return (int)(sizeof(unsigned long long) * 8 - 1) - __builtin_clzll(size);
+}
+
+static int size_to_bin(size_t size) {
+  if (size < BIN_LINEAR_LIMIT)
+    return (int)(size / MEM_ALIGN);
+  int fl = floor_log2(size);
+  int sl = (int)(size >> (fl - BIN_SUB_LOG2)) & (BIN_SUB_COUNT - 1);
+  int bin = (fl - floor_log2(BIN_LINEAR_LIMIT) + 1) * BIN_SUB_COUNT + sl;
+  return bin < NUMBER_BINS ? bin : NUMBER_BINS - 1;
+}
+
+/* First bin whose blocks are all large enough for size */
+static int size_to_bin_round_up(size_t size) {
+  if (size >= BIN_LINEAR_LIMIT) {
+    size += ((size_t)1 << (floor_log2(size) - BIN_SUB_LOG2)) - 1;
+  }
+  return size_to_bin(size);
+}
+
+static void bin_insert(Heap *heap, BlockHeader *block) {
+  int bin = size_to_bin(block->size);
+  dllist_push_front(&heap->bins[bin], block);
+  heap->bin_map |= (uint64_t)1 << bin;
+  heap->counters.free_blocks++;
+  heap->counters.free_bytes += block->size;
+}
+
+static void bin_remove(Heap *heap, BlockHeader *block) {
+  int bin = size_to_bin(block->size);
+  heap->counters.free_blocks--;
+  heap->counters.free_bytes -= block->size;
+  dllist_remove(&heap->bins[bin], block);
+  if (heap->bins[bin].head == NULL) {
+    heap->bin_map &= ~((uint64_t)1 << bin);
+  }
+}
+
+static BlockHeader *next_block_in_mem(BlockHeader *block) {
+  return (BlockHeader *)((char *)block + block->size + BLOCK_SIZE);
+}
+
+static BlockHeader *previous_block_in_mem(BlockHeader *block) {
+  return (BlockHeader *)((char *)block - BLOCK_SIZE -
+                         (block->previous_footer & FOOTER_SIZE_MASK));
+}
+
+/* Must follow every change of the size or the tag flags of a heap block */
+static void write_footer(BlockHeader *block) {
+  next_block_in_mem(block)->previous_footer =
+      block->size | (size_t)(block->flags & FOOTER_FLAGS);
+}
+
+void split_block(Heap *heap, BlockHeader *block, size_t size) {
   size_t old_size = block->size;
-  size = fit_to_memalign(size);
+  /* Cached and remotely freed blocks keep a link in their first word */
+  size = size < MEM_ALIGN ? MEM_ALIGN : fit_to_memalign(size);
   if (old_size > size + BLOCK_SIZE) {
     block->size = size;
     BlockHeader *next_free = (BlockHeader *)((char *)get_start(block) + size);
     block_init(next_free, old_size - size - BLOCK_SIZE);
-    next_free->flags = 0;
-    next_free->previous_in_mem = block;
-    dllist_add_after(free_list, next_free, block);
+    write_footer(block);
+    write_footer(next_free);
+    bin_insert(heap, next_free);
   }
 }
 
@@ -68,185 +300,1062 @@ static BlockHeader *get_free_first_fit(DLList *free_list, size_t size) {
   return chunk_it;
 }
 
-static BlockHeader *find_free_block(DLList *free_list, size_t size) {
-  return get_free_first_fit(free_list, size);
+static BlockHeader *find_free_block(Heap *heap, size_t size) {
+  size = fit_to_memalign(size);
+  int exact = size_to_bin(size);
+  BlockHeader *head = heap->bins[exact].head;
+  if (head != NULL && head->size >= size) {
+    return head;
+  }
+  int bin = size_to_bin_round_up(size);
+  uint64_t candidates = heap->bin_map & (~(uint64_t)0 << bin);
+  if (candidates == 0) {
+    return NULL;
+  }
+  bin = __builtin_ctzll(candidates);
+  if (bin < NUMBER_BINS - 1) {
+    return heap->bins[bin].head;
+  }
+  return get_free_first_fit(&heap->bins[bin], size);
 }
 
-HeapHeader *get_new_heap_block(Heap *heap, size_t size) {
+/* Bytes a heap grows by to fit a block of size bytes. Growth is
+   geometric, so a heap needs few steps and few TLB entries to cover it */
+static size_t heap_growth(Heap *heap, size_t size) {
   size_t min_size =
-      ((size + HEAP_HEADER_SIZE + PAGE_DIV - 1) / PAGE_DIV) * PAGE_DIV;
-  size_t block_size = min_size < PAGE_MIN_SIZE ? PAGE_MIN_SIZE : min_size;
-  HeapHeader *block = (HeapHeader *)page_alloc(block_size);
-  if (block != NULL) {
-    // In heap_free a check on next block in mem is made,
-    // so a last dead block is reserved to avoid invalid read
-    // TODO: find a better solution
-    block->size = block_size - HEAP_HEADER_SIZE - BLOCK_SIZE;
-    block->next = NULL;
-    block->previous = NULL;
-    dllist_push(&heap->heap, block);
-    return block;
+      ((size + HEAP_HEADER_SIZE + 2 * BLOCK_SIZE + CHUNK_ALIGN - 1) /
+       CHUNK_ALIGN) *
+      CHUNK_ALIGN;
+  return min_size < heap->chunk_size ? heap->chunk_size : min_size;
+}
+
+/* Lays out a chunk of chunk_size bytes: its header, then its first block,
+   still to be freed, then the occupied fence block */
+static BlockHeader *chunk_init(HeapHeader *chunk, size_t chunk_size) {
+  chunk->size = chunk_size - HEAP_HEADER_SIZE - BLOCK_SIZE;
+  chunk->next = NULL;
+  chunk->previous = NULL;
+  BlockHeader *fence = (BlockHeader *)((char *)chunk + chunk_size - BLOCK_SIZE);
+  block_init(fence, 0);
+  fence->flags = MY_BLOCK_OCCUPIED | MY_BLOCK_FENCE;
+  BlockHeader *block = (BlockHeader *)((char *)get_start(chunk));
+  block_init(block, chunk->size - BLOCK_SIZE);
+  block->previous_footer = MY_BLOCK_OCCUPIED | MY_BLOCK_FENCE;
+  return block;
+}
+
+/* Moves pooled chunks, whose pages are already faulted in, over the
+   start of a reserved range of size bytes. Returns how many bytes it
+   filled */
+static size_t span_fill_from_pool(char *start, size_t size) {
+  size_t filled = 0;
+  while (filled < size) {
+    size_t piece = size - filled;
+    char *chunk = (char *)chunk_pool_get(piece, PAGE_DIV);
+    if (chunk == NULL) {
+      piece = CHUNK_ALIGN;
+      chunk = (char *)chunk_pool_get(piece, PAGE_DIV);
+    }
+    if (chunk == NULL)
+      break;
+    if (!page_move(chunk, start + filled, piece)) {
+      chunk_pool_put(chunk, piece);
+      break;
+    }
+    filled += piece;
+  }
+  return filled;
+}
+
+/* Commits size more bytes at the top of the heap's span, taking pooled
+   chunks first. The old fence becomes the header of the new space,
+   returned as a block to be freed */
+static BlockHeader *heap_span_grow(Heap *heap, int16_t heap_index,
+                                   size_t size) {
+  PageInfo info = {0, heap_index, PAGE_KIND_HEAP, 0};
+  if ((size_t)(heap->block_end - heap->block_top) < size ||
+      !pagemap_set(heap->block_top, size, info))
+    return NULL;
+  size_t filled = span_fill_from_pool(heap->block_top, size);
+  if (filled < size &&
+      !page_commit(heap->block_top + filled, size - filled))
+    return NULL;
+  if (huge_pages != PAGE_HUGE_OFF)
+    page_advise_huge(heap->block_top, size);
+  numa_bind(heap->block_top, size, heap_index % numa_nodes);
+  HeapHeader *chunk = (HeapHeader *)(heap->block_end - HEAP_SPAN);
+  BlockHeader *block;
+  if (heap->block_top == (char *)chunk) {
+    block = chunk_init(chunk, size);
   } else {
+    block = (BlockHeader *)(heap->block_top - BLOCK_SIZE);
+    block_init(block, size - BLOCK_SIZE);
+    chunk->size += size;
+    BlockHeader *fence =
+        (BlockHeader *)(heap->block_top + size - BLOCK_SIZE);
+    block_init(fence, 0);
+    fence->flags = MY_BLOCK_OCCUPIED | MY_BLOCK_FENCE;
+  }
+  heap->block_top += size;
+  return block;
+}
+
+/* The pool splits chunks at page boundaries and moves them into spans,
+   neither of which hugetlbfs pages allow, so chunks of them are unmapped
+   instead */
+static void heap_chunk_release(void *chunk, size_t size, PageInfo info) {
+  if (info.hugetlb)
+    page_free(chunk, size);
+  else
+    chunk_pool_put(chunk, size);
+}
+
+/* Takes a chunk of its own from the pool or maps one, for heaps without
+   a span to grow. With hugetlbfs pages the pool only serves as fallback */
+static BlockHeader *get_new_heap_block(Heap *heap, int16_t heap_index,
+                                       size_t size) {
+  PageInfo info = {0, heap_index, PAGE_KIND_HEAP, 0};
+  HeapHeader *chunk = NULL;
+  if (huge_pages == PAGE_HUGE_TLB) {
+    chunk = (HeapHeader *)page_alloc_hugetlb(size, CHUNK_ALIGN);
+    info.hugetlb = chunk != NULL;
+  }
+  if (chunk == NULL)
+    chunk = (HeapHeader *)chunk_pool_get(size, CHUNK_ALIGN);
+  if (chunk == NULL)
+    chunk = (HeapHeader *)page_alloc_aligned(
+        size, CHUNK_ALIGN,
+        huge_pages == PAGE_HUGE_OFF ? PAGE_HUGE_OFF : PAGE_HUGE_ADVISE);
+  if (chunk == NULL)
+    return NULL;
+  if (!pagemap_set(chunk, size, info)) {
+    heap_chunk_release(chunk, size, info);
     return NULL;
   }
+  numa_bind(chunk, size, heap_index % numa_nodes);
+  dllist_push(&heap->heap, chunk);
+  return chunk_init(chunk, size);
+}
+
+/* Heap h serves NUMA node h % numa_nodes. A thread takes the heap of its
+   node that the fewest threads use, so that the heaps of exited threads
+   and their free memory are taken up again. Ties go to the heap of its
+   CPU */
+static int16_t heap_for_thread(int cpu, int node) {
+  int16_t count = heap_count;
+  int16_t per_node = (int16_t)(count / numa_nodes);
+  int16_t best = (int16_t)(node + numa_nodes * (cpu % per_node));
+  for (int16_t i = (int16_t)node; i < count; i += numa_nodes) {
+    if (heaps[i].counters.threads < heaps[best].counters.threads)
+      best = i;
+  }
+  return best;
+}
+
+/* Moves the thread's claim to another heap, or drops it with -1 */
+static void set_thread_heap(int16_t heap_index) {
+  if (thread_index != -1)
+    atomic_fetch_sub_explicit(&heaps[thread_index].counters.threads, 1,
+                              memory_order_relaxed);
+  if (heap_index != -1)
+    atomic_fetch_add_explicit(&heaps[heap_index].counters.threads, 1,
+                              memory_order_relaxed);
+  thread_index = heap_index;
+}
+
+static void init_thread_index() {
+  if (thread_index == -1) {
+    int node;
+    int cpu = numa_getcpu(&node);
+    if (cpu < 0)
+      cpu = 0;
+    set_thread_heap(heap_for_thread(cpu, node));
+#ifndef MYMALLOC_NO_THREADING
+    /* Any non-NULL value, so that thread_exit runs */
+    pthread_setspecific(thread_key, &tcache);
+#endif
+  }
+}
+
+static int is_free(BlockHeader *block) {
+  return !(block->flags & MY_BLOCK_OCCUPIED);
+}
+
+/* Merges a free block that is in no bin with its free neighbours and bins
+   the result, which it returns. Both neighbours are found from the block
+   itself: the next one from its size, the previous one from its footer,
+   and the fences at both ends of a chunk stop the merge */
+static BlockHeader *heap_insert_free(Heap *heap, BlockHeader *block) {
+  BlockHeader *block_next = next_block_in_mem(block);
+  if (is_free(block_next)) {
+    bin_remove(heap, block_next);
+    block->size += block_next->size + BLOCK_SIZE;
+  }
+  if (!(block->previous_footer & MY_BLOCK_OCCUPIED)) {
+    BlockHeader *block_previous = previous_block_in_mem(block);
+    bin_remove(heap, block_previous);
+    block_previous->size += block->size + BLOCK_SIZE;
+    block = block_previous;
+  }
+  block->flags &= ~MY_BLOCK_PURGED;
+  write_footer(block);
+  bin_insert(heap, block);
+  if (block->size >= PURGE_MIN_SIZE)
+    heap_schedule_purge(heap);
+  return block;
+}
+
+/* Grows the heap by at least size bytes, preferably within its span, and
+   returns the binned free block that holds the new memory. hugetlbfs
+   pages cannot be committed into a reservation, so with them every
+   growth maps a chunk */
+static BlockHeader *heap_grow(Heap *heap, int16_t heap_index, size_t size) {
+  size_t growth = heap_growth(heap, size);
+  BlockHeader *block = NULL;
+  if (heap->block_top != NULL && huge_pages != PAGE_HUGE_TLB)
+    block = heap_span_grow(heap, heap_index, growth);
+  if (block == NULL)
+    block = get_new_heap_block(heap, heap_index, growth);
+  if (block == NULL)
+    return NULL;
+  if (heap->chunk_size < CHUNK_MAX_SIZE)
+    heap->chunk_size *= 2;
+  heap->counters.mapped_bytes += growth;
+  return heap_insert_free(heap, block);
+}
+
+static void heap_free_block(Heap *heap, BlockHeader *block) {
+  block->flags &= ~MY_BLOCK_OCCUPIED;
+  heap->counters.in_use_bytes -= block->size;
+  heap_insert_free(heap, block);
 }
 
-static void *heap_malloc(int16_t heap_index, size_t size) {
+void heap_block_free(HeapHeader *heap) {
+  size_t true_size = heap->size + HEAP_HEADER_SIZE + BLOCK_SIZE;
+  PageInfo info = pagemap_get(heap);
+  pagemap_clear(heap, true_size);
+  heap_chunk_release(heap, true_size, info);
+}
+
+static int is_chunk_empty(BlockHeader *block) {
+  return (block->previous_footer & MY_BLOCK_FENCE) &&
+         (next_block_in_mem(block)->flags & MY_BLOCK_FENCE);
+}
+
+/* Unmaps the empty chunks of the heap beyond RETAIN_EMPTY_CHUNKS and
+   gives back the whole pages inside the other large free blocks */
+static void heap_purge(Heap *heap) {
+  int empty_chunks = 0;
+  heap->purge_deadline = 0;
+  slab_purge(heap);
+  for (int bin = size_to_bin(PURGE_MIN_SIZE); bin < NUMBER_BINS; bin++) {
+    BlockHeader *block = heap->bins[bin].head;
+    while (block != NULL) {
+      BlockHeader *next = block->next;
+      if (block->size < PURGE_MIN_SIZE) {
+        ;
+      } else if (is_chunk_empty(block) && !is_in_heap_region(block) &&
+                 empty_chunks++ >= RETAIN_EMPTY_CHUNKS) {
+        HeapHeader *chunk = (HeapHeader *)((char *)block - BLOCK_SIZE);
+        bin_remove(heap, block);
+        dllist_remove(&heap->heap, chunk);
+        heap->counters.mapped_bytes -=
+            chunk->size + HEAP_HEADER_SIZE + BLOCK_SIZE;
+        heap_block_free(chunk);
+        if (heap->chunk_size > CHUNK_MIN_SIZE)
+          heap->chunk_size /= 2;
+      } else if (!(block->flags & MY_BLOCK_PURGED)) {
+        char *start = (char *)fit_to_page((size_t)get_start(block));
+        char *end =
+            (char *)((size_t)next_block_in_mem(block) / PAGE_DIV * PAGE_DIV);
+        if (end > start)
+          page_purge(start, (size_t)(end - start));
+        block->flags |= MY_BLOCK_PURGED;
+      }
+      block = next;
+    }
+  }
+}
+
+static void heap_maybe_purge(Heap *heap) {
+  if (heap->purge_deadline != 0 && now_ns() >= heap->purge_deadline)
+    heap_purge(heap);
+}
+
+/* Frees a slab object or a heap block, called with the heap lock held */
+static void heap_release(Heap *heap, void *pointer) {
+  if (is_slab_object(pointer)) {
+    if (slab_free(heap, pointer))
+      heap_schedule_purge(heap);
+  } else {
+    heap_free_block(heap, (BlockHeader *)((char *)(pointer)-BLOCK_SIZE));
+  }
+}
+
+static void heap_free(Heap *heap, void *pointer) {
+  lock_acquire(heap->lock);
+  heap_release(heap, pointer);
+  heap_maybe_purge(heap);
+  lock_release(heap->lock);
+}
+
+static int16_t heap_index_of(void *pointer) {
+  return pagemap_get(pointer).heap_index;
+}
+
+static size_t usable_size_of(void *pointer, PageInfo info) {
+  if (info.kind == PAGE_KIND_SLAB)
+    return info.object_size;
+  return ((BlockHeader *)((char *)(pointer)-BLOCK_SIZE))->size;
+}
+
+static size_t usable_size(void *pointer) {
+  return usable_size_of(pointer, pagemap_get(pointer));
+}
+
+/* Memory freed by threads of other heaps, pushed without the heap lock */
+static void remote_free_push(Heap *heap, void *pointer) {
+  atomic_fetch_add_explicit(&heap->counters.remote_frees, 1,
+                            memory_order_relaxed);
+  void *head = atomic_load_explicit(&heap->remote_free, memory_order_relaxed);
+  do {
+    *(void **)pointer = head;
+  } while (!atomic_compare_exchange_weak_explicit(&heap->remote_free, &head,
+                                                  pointer, memory_order_release,
+                                                  memory_order_relaxed));
+}
+
+/* Called with the heap lock held */
+static void remote_free_drain(Heap *heap) {
+  if (atomic_load_explicit(&heap->remote_free, memory_order_relaxed) == NULL)
+    return;
+  void *list =
+      atomic_exchange_explicit(&heap->remote_free, NULL, memory_order_acquire);
+  while (list != NULL) {
+    void *pointer = list;
+    list = *(void **)list;
+    heap_release(heap, pointer);
+  }
+}
+
+/* Hands a singly linked list of cached memory back to its heaps: memory
+   of the thread's heap under a single lock, the rest through the remote
+   free lists */
+static void tcache_release(void *list) {
+  void *own = NULL;
+  while (list != NULL) {
+    void *pointer = list;
+    list = *(void **)list;
+    int16_t heap_index = heap_index_of(pointer);
+    if (heap_index == thread_index) {
+      *(void **)pointer = own;
+      own = pointer;
+    } else {
+      remote_free_push(heaps + heap_index, pointer);
+    }
+  }
+  if (own != NULL) {
+    Heap *heap = heaps + thread_index;
+    lock_acquire(heap->lock);
+    while (own != NULL) {
+      void *pointer = own;
+      own = *(void **)own;
+      heap_release(heap, pointer);
+    }
+    heap_maybe_purge(heap);
+    lock_release(heap->lock);
+  }
+}
+
+static int tcache_is_current() {
+  if (tcache.generation != heap_generation) {
+    /* Heaps were reset by my_cleanup, cached blocks are gone */
+    tcache = (ThreadCache){0};
+    tcache.generation = heap_generation;
+    return 0;
+  }
+  return 1;
+}
+
+static void tcache_flush_bin(int bin, unsigned count) {
+  void *list = NULL;
+  for (unsigned i = 0; i < count && tcache.bins[bin] != NULL; i++) {
+    void *pointer = tcache.bins[bin];
+    tcache.bins[bin] = *(void **)pointer;
+    tcache.counts[bin]--;
+    *(void **)pointer = list;
+    list = pointer;
+  }
+  tcache_release(list);
+}
+
+void tcache_flush() {
+  if (!tcache_is_current())
+    return;
+  for (int bin = 0; bin < TCACHE_BINS; bin++) {
+    tcache_flush_bin(bin, tcache.counts[bin]);
+  }
+}
+
+#ifndef MYMALLOC_NO_THREADING
+/* Gives the thread's cached memory back and its heap up. Should a later
+   destructor allocate, the thread takes a heap again and this runs once
+   more */
+static void thread_exit(void *unused) {
+  tcache_flush();
+  log_thread_exit();
+  set_thread_heap(-1);
+}
+#endif
+
+static void *tcache_get(size_t size) {
+  if (size > TCACHE_MAX_SIZE || !tcache_is_current())
+    return NULL;
+  int bin = (int)(fit_to_memalign(size) / MEM_ALIGN);
+  void *pointer = tcache.bins[bin];
+  if (pointer == NULL)
+    return NULL;
+  tcache.bins[bin] = *(void **)pointer;
+  tcache.counts[bin]--;
+  return pointer;
+}
+
+static int tcache_put(void *pointer, size_t size) {
+  if (size > TCACHE_MAX_SIZE)
+    return 0;
+  tcache_is_current();
+  int bin = (int)(size / MEM_ALIGN);
+  if (tcache.counts[bin] >= TCACHE_BIN_CAPACITY) {
+    tcache_flush_bin(bin, TCACHE_BIN_CAPACITY / 2);
+  }
+  *(void **)pointer = tcache.bins[bin];
+  tcache.bins[bin] = pointer;
+  tcache.counts[bin]++;
+  return 1;
+}
+
+/* Moves the start of a free block that is in no bin up to the next multiple
+   of alignment with room for a header and a free list link in front, and
+   gives the bytes in front back as a free block. The padding is then at
+   most alignment + BLOCK_SIZE bytes */
+static BlockHeader *align_block(Heap *heap, BlockHeader *block,
+                                size_t alignment) {
+  char *start = get_start(block);
+  char *aligned =
+      (char *)(((size_t)start + alignment - 1) & ~(alignment - 1));
+  if (aligned == start)
+    return block;
+  while ((size_t)(aligned - start) < BLOCK_SIZE + MEM_ALIGN)
+    aligned += alignment;
+  BlockHeader *result = (BlockHeader *)(aligned - BLOCK_SIZE);
+  result->size = block->size - (size_t)(aligned - start);
+  result->flags = MY_BLOCK_OCCUPIED;
+  write_footer(result);
+  /* heap_insert_free writes the footer of the padding into result */
+  block->size = (size_t)(aligned - start) - BLOCK_SIZE;
+  heap_insert_free(heap, block);
+  return result;
+}
+
+/* alignment is a power of two; above MEM_ALIGN, size must leave room for
+   alignment + BLOCK_SIZE more bytes */
+static void *heap_malloc(int16_t heap_index, size_t alignment, size_t size) {
   Heap *heap = heaps + heap_index;
   BlockHeader *block;
-  block = find_free_block(&heap->free_list, size);
+  size_t request = size;
+  if (alignment > MEM_ALIGN)
+    request += alignment + BLOCK_SIZE;
+  remote_free_drain(heap);
+  if (alignment <= MEM_ALIGN && size <= SLAB_MAX_SIZE) {
+    void *object = slab_alloc(heap, heap_index, size);
+    if (object != NULL)
+      return object;
+  }
+  block = find_free_block(heap, request);
   if (block == NULL) {
-    HeapHeader *heap_block = get_new_heap_block(heap, size);
-    if (heap_block == NULL) {
+    block = heap_grow(heap, heap_index, request);
+    if (block == NULL) {
       return NULL;
     }
-    block = (BlockHeader *)((char *)get_start(heap_block));
-    block->size = heap_block->size - BLOCK_SIZE;
-    block->flags = 0;
-    block->previous_in_mem = NULL;
-    dllist_push(&heap->free_list, block);
   }
-  split_block(&heap->free_list, block, size);
-  dllist_remove(&heap->free_list, block);
-  block->flags |= MY_BLOCK_OCCUPIED;
+  bin_remove(heap, block);
+  if (alignment > MEM_ALIGN)
+    block = align_block(heap, block, alignment);
+  split_block(heap, block, size);
+  block->flags = MY_BLOCK_OCCUPIED;
+  write_footer(block);
   block->heap_index = heap_index;
+  heap->counters.in_use_bytes += block->size;
+  heap_maybe_purge(heap);
   return (void *)get_start(block);
 }
 
-static int try_malloc_on_heap(int16_t heap_index, size_t size,
-                              void **allocated_mem) {
-  *allocated_mem = NULL;
-  if (lock_try_acquire(heaps[heap_index].lock) == 0) {
-    *allocated_mem = heap_malloc(heap_index, size);
-    lock_release(heaps[heap_index].lock);
-    return 1;
+/* Allocates count blocks of size bytes, called with the heap lock held.
+   Blocks that do not come from slabs are carved one after the other from
+   a single free region. Returns how many were allocated */
+static size_t heap_malloc_batch(int16_t heap_index, size_t size, size_t count,
+                                void **pointers) {
+  Heap *heap = heaps + heap_index;
+  size_t done = 0;
+  remote_free_drain(heap);
+  if (size <= SLAB_MAX_SIZE) {
+    while (done < count &&
+           (pointers[done] = slab_alloc(heap, heap_index, size)) != NULL) {
+      done++;
+    }
+  }
+  size_t block_size = size < MEM_ALIGN ? MEM_ALIGN : fit_to_memalign(size);
+  size_t remaining = count - done;
+  BlockHeader *block = NULL;
+  if (remaining > 0 &&
+      remaining <= (SIZE_MAX / 2) / (block_size + BLOCK_SIZE)) {
+    size_t region_size = remaining * (block_size + BLOCK_SIZE) - BLOCK_SIZE;
+    block = find_free_block(heap, region_size);
+    if (block == NULL)
+      block = heap_grow(heap, heap_index, region_size);
+    if (block != NULL)
+      bin_remove(heap, block);
+  }
+  while (block != NULL) {
+    BlockHeader *next = NULL;
+    if (done + 1 < count) {
+      next = (BlockHeader *)(get_start(block) + block_size);
+      block_init(next, block->size - block_size - BLOCK_SIZE);
+      block->size = block_size;
+    } else {
+      split_block(heap, block, size);
+    }
+    block->flags = MY_BLOCK_OCCUPIED;
+    write_footer(block);
+    block->heap_index = heap_index;
+    heap->counters.in_use_bytes += block->size;
+    pointers[done++] = get_start(block);
+    block = next;
+  }
+  /* Without a region large enough, one block at a time */
+  while (done < count &&
+         (pointers[done] = heap_malloc(heap_index, MEM_ALIGN, size)) != NULL) {
+    done++;
   }
+  heap_maybe_purge(heap);
+  return done;
+}
+
+static int try_lock_heap(int16_t heap_index) {
+  if (lock_try_acquire(heaps[heap_index].lock) == 0)
+    return 1;
+  atomic_fetch_add_explicit(&heaps[heap_index].counters.trylock_failures, 1,
+                            memory_order_relaxed);
   return 0;
 }
 
-static void init_thread_index() {
-  if (thread_index == -1) {
-    thread_index = global_thread_count % NUMBER_HEAPS;
-    global_thread_count++;
-  }
-}
-
-static void log_allocation(void *ptr, size_t size) {
-  FILE *flog;
-  char datestr[64];
-  struct tm the_time;
-  if ((flog = fopen(LOG_FILE, "a")) != NULL) {
-    time_t raw_time = time(NULL);
-    localtime_r(&raw_time, &the_time);
-    strftime(datestr, 64, "[%B %d %Y][%H:%M]", &the_time);
-    lock_acquire(init_lock);
-    fprintf(flog, "%s malloc'd %zu byte%s at address %p\n", datestr, size,
-            size <= 1 ? "" : "s", ptr);
-    fflush(flog);
-    lock_release(init_lock);
-    fclose(flog);
+/* Spins a little on a busy heap before sleeping on its lock */
+static void lock_heap_blocking(int16_t heap_index) {
+  for (int i = 0; i < HEAP_SPIN_TRIES; i++) {
+    if (try_lock_heap(heap_index))
+      return;
+    cpu_relax();
   }
+  HeapCounters *counters = &heaps[heap_index].counters;
+  uint64_t start = precise_now_ns();
+  lock_acquire(heaps[heap_index].lock);
+  atomic_fetch_add_explicit(&counters->lock_waits, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&counters->lock_wait_ns, precise_now_ns() - start,
+                            memory_order_relaxed);
 }
 
-void *my_malloc(size_t size) {
-  if (global_thread_count < 0)
-    my_init();
-  init_thread_index();
-  void *ret = NULL;
-  int wait_time = 1;
-  int found = 0;
-  while (!found) {
-    if (try_malloc_on_heap(thread_index, size, &ret)) {
-      found = 1;
-      break;
+/* Brings one more heap per NUMA node into use, returns the new heap of
+   the thread's node or -1 once MAX_HEAPS are used */
+static int16_t add_heap() {
+  int16_t count = heap_count;
+  while (count + numa_nodes <= MAX_HEAPS) {
+    if (atomic_compare_exchange_weak(&heap_count, &count,
+                                     count + numa_nodes)) {
+      return (int16_t)(count + thread_index % numa_nodes);
     }
+  }
+  return -1;
+}
 
-    for (int16_t i = 0; i < NUMBER_HEAPS; i++) {
-      if (try_malloc_on_heap(i, size, &ret)) {
-        found = 1;
-        break;
-      }
+static char *mapping_of(BlockHeader *block) {
+  return (char *)block - block->previous_footer;
+}
+
+static size_t mapped_length(BlockHeader *block) {
+  return block->previous_footer + BLOCK_SIZE + block->size;
+}
+
+/* alignment is a power of two */
+/* Sizes this close to SIZE_MAX wrap around once a header, the padding
+   for alignment and the rounding to pages are added */
+static int size_too_large(size_t alignment, size_t size) {
+  size_t padding = alignment > MEM_ALIGN ? alignment : 0;
+  return size > SIZE_MAX - BLOCK_SIZE - PAGE_DIV - padding;
+}
+
+static void *mapped_alloc(size_t alignment, size_t size) {
+  size_t padding = alignment > MEM_ALIGN ? alignment : 0;
+  if (size_too_large(alignment, size))
+    return NULL;
+  size_t length = fit_to_page(size + BLOCK_SIZE + padding);
+  int8_t flags = MY_BLOCK_OCCUPIED | MY_BLOCK_MAPPED | MY_BLOCK_POOLED;
+  char *mapping = (char *)chunk_pool_get(length, PAGE_DIV);
+  if (mapping == NULL) {
+    mapping = (char *)page_alloc(length);
+    flags = MY_BLOCK_OCCUPIED | MY_BLOCK_MAPPED;
+  }
+  if (mapping == NULL)
+    return NULL;
+  char *start = (char *)(((size_t)mapping + BLOCK_SIZE + alignment - 1) &
+                         ~(alignment - 1));
+  PageInfo info = {0, -1, PAGE_KIND_MAPPED, 0};
+  if (!pagemap_set(start, 1, info)) {
+    chunk_pool_put(mapping, length);
+    return NULL;
+  }
+  BlockHeader *block = (BlockHeader *)(start - BLOCK_SIZE);
+  block->size = (size_t)(mapping + length - start);
+  block->flags = flags;
+  block->heap_index = -1;
+  block->previous_footer = (size_t)((char *)block - mapping);
+  atomic_fetch_add_explicit(&large_mapped_bytes, length, memory_order_relaxed);
+  atomic_fetch_add_explicit(&large_blocks, 1, memory_order_relaxed);
+  return (void *)get_start(block);
+}
+
+static void mapped_free(BlockHeader *block) {
+  void *mapping = mapping_of(block);
+  size_t length = mapped_length(block);
+  pagemap_clear(get_start(block), 1);
+  atomic_fetch_sub_explicit(&large_mapped_bytes, length, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&large_blocks, 1, memory_order_relaxed);
+  chunk_pool_put(mapping, length);
+}
+
+/* Resizes the mapping with page_realloc, so contents are not copied */
+static void *mapped_realloc(BlockHeader *block, size_t new_size) {
+  char *mapping = mapping_of(block);
+  size_t offset = block->previous_footer;
+  if (new_size > SIZE_MAX - offset - BLOCK_SIZE - PAGE_DIV)
+    return NULL;
+  size_t length = fit_to_page(offset + BLOCK_SIZE + new_size);
+  size_t old_length = mapped_length(block);
+  if (length != old_length) {
+    char *old_start = get_start(block);
+    mapping = (char *)page_realloc(mapping, old_length, length);
+    if (mapping == NULL)
+      return NULL;
+    block = (BlockHeader *)(mapping + offset);
+    if (get_start(block) != old_start) {
+      PageInfo info = {0, -1, PAGE_KIND_MAPPED, 0};
+      pagemap_clear(old_start, 1);
+      /* Fails only without memory for a node of the map, then the block
+         cannot be freed and leaks */
+      pagemap_set(get_start(block), 1, info);
     }
-    if (!found) {
-      usleep(wait_time);
-      wait_time *= 2;
+    atomic_fetch_add_explicit(&large_mapped_bytes, length - old_length,
+                              memory_order_relaxed);
+  }
+  block->size = length - offset - BLOCK_SIZE;
+  return (void *)get_start(block);
+}
+
+/* Locks the thread's heap, or when it is busy a free heap of the same
+   node, which the thread then sticks to. When all of them are busy a new
+   heap is brought in, or the thread waits for its own. Returns the index
+   of the locked heap */
+static int16_t lock_thread_heap() {
+  if (try_lock_heap(thread_index))
+    return thread_index;
+  int16_t count = heap_count;
+  for (int16_t i = thread_index % numa_nodes; i < count; i += numa_nodes) {
+    if (i != thread_index && try_lock_heap(i)) {
+      set_thread_heap(i);
+      return i;
     }
   }
-  if (ret != NULL)
-    log_allocation(ret, size);
+  int16_t fresh = add_heap();
+  if (fresh >= 0) {
+    set_thread_heap(fresh);
+  }
+  lock_heap_blocking(thread_index);
+  return thread_index;
+}
 
+/* alignment is a power of two */
+static void *malloc_internal(size_t alignment, size_t size) {
+  if (size_too_large(alignment, size))
+    return NULL;
+  if (!initialized)
+    my_init();
+  init_thread_index();
+  if (size >= mmap_threshold || alignment >= mmap_threshold)
+    return mapped_alloc(alignment, size);
+  void *ret = NULL;
+  if (alignment <= MEM_ALIGN) {
+    ret = tcache_get(size);
+  }
+  if (ret != NULL) {
+    return ret;
+  }
+  int16_t heap_index = lock_thread_heap();
+  ret = heap_malloc(heap_index, alignment, size);
+  lock_release(heaps[heap_index].lock);
   return ret;
 }
 
-static int is_free(BlockHeader *block) {
-  return !(block->flags & MY_BLOCK_OCCUPIED);
+void *my_malloc(size_t size) {
+  void *ret = malloc_internal(MEM_ALIGN, size);
+  if (ret != NULL && log_is_enabled())
+    log_event(LOG_OP_MALLOC, ret, NULL, size, heap_index_of(ret));
+
+  return ret;
 }
 
-static BlockHeader *next_block_in_mem(BlockHeader *block) {
-  return (BlockHeader *)((char *)block + block->size + BLOCK_SIZE);
+/* info is the page map entry of pointer */
+static void free_internal(void *pointer, PageInfo info) {
+  init_thread_index();
+  if (info.kind == PAGE_KIND_NONE) {
+    fprintf(stderr, "ERROR: Cannot free %p, it was not allocated here\n",
+            pointer);
+    return;
+  }
+  if (info.kind == PAGE_KIND_MAPPED) {
+    mapped_free((BlockHeader *)((char *)(pointer)-BLOCK_SIZE));
+    return;
+  }
+  if (tcache_put(pointer, usable_size_of(pointer, info)))
+    return;
+  if (info.heap_index != thread_index) {
+    remote_free_push(heaps + info.heap_index, pointer);
+  } else {
+    heap_free(heaps + info.heap_index, pointer);
+  }
 }
 
-static void heap_free(Heap *heap, void *pointer) {
-  BlockHeader *block = (BlockHeader *)((char *)(pointer)-BLOCK_SIZE);
-  /* split_block puts block->previous and block->next */
-  BlockHeader *block_next = next_block_in_mem(block);
-  if (block->next == block_next && is_free(block_next)) {
-    block->size += block_next->size + BLOCK_SIZE;
-    lock_acquire(heap->lock);
-    dllist_remove(&heap->free_list, block_next);
-    lock_release(heap->lock);
+void *my_calloc(size_t count, size_t size) {
+  if (size != 0 && count > SIZE_MAX / size)
+    return NULL;
+  void *ret = my_malloc(count * size);
+  /* Fresh mappings are already zeroed */
+  if (ret != NULL && (pagemap_get(ret).kind != PAGE_KIND_MAPPED ||
+                      (((BlockHeader *)((char *)ret - BLOCK_SIZE))->flags &
+                       MY_BLOCK_POOLED)))
+    memset(ret, 0, count * size);
+  return ret;
+}
+
+void *my_aligned_alloc(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    return NULL;
+  void *ret = malloc_internal(alignment, size);
+  if (ret != NULL && log_is_enabled())
+    log_event(LOG_OP_MALLOC, ret, NULL, size, heap_index_of(ret));
+  return ret;
+}
+
+size_t my_malloc_usable_size(void *pointer) {
+  if (pointer == NULL)
+    return 0;
+  return usable_size(pointer);
+}
+
+void my_free(void *pointer) {
+  if (!initialized || pointer == NULL)
+    return;
+  PageInfo info = pagemap_get(pointer);
+  /* Pointers free_internal rejects are not logged */
+  if (info.kind != PAGE_KIND_NONE && log_is_enabled())
+    log_event(LOG_OP_FREE, pointer, NULL, 0, info.heap_index);
+  free_internal(pointer, info);
+}
+
+size_t my_malloc_batch(size_t size, size_t count, void **pointers) {
+  size_t done = 0;
+  if (size_too_large(MEM_ALIGN, size))
+    return 0;
+  if (!initialized)
+    my_init();
+  init_thread_index();
+  if (size >= mmap_threshold) {
+    while (done < count &&
+           (pointers[done] = mapped_alloc(MEM_ALIGN, size)) != NULL) {
+      done++;
+    }
+  } else {
+    while (done < count && (pointers[done] = tcache_get(size)) != NULL) {
+      done++;
+    }
+    if (done < count) {
+      int16_t heap_index = lock_thread_heap();
+      done += heap_malloc_batch(heap_index, size, count - done,
+                                pointers + done);
+      lock_release(heaps[heap_index].lock);
+    }
   }
-  if (block->previous_in_mem != NULL) {
-    BlockHeader *next = next_block_in_mem(block->previous_in_mem);
-    if (next == block) {
-      lock_acquire(heap->lock);
-      if (is_free(block_next)) {
-        block->previous_in_mem->size += block->size + BLOCK_SIZE;
-        lock_release(heap->lock);
-        return;
-      }
-      lock_release(heap->lock);
+  if (log_is_enabled()) {
+    for (size_t i = 0; i < done; i++) {
+      log_event(LOG_OP_MALLOC, pointers[i], NULL, size,
+                heap_index_of(pointers[i]));
     }
   }
-  block->flags &= ~MY_BLOCK_OCCUPIED;
-  lock_acquire(heap->lock);
-  dllist_push_front(&heap->free_list, block);
+  return done;
+}
+
+/* Frees the memory of one heap linked through its first word, under a
+   single lock. A busy heap other than the thread's gets it through its
+   remote free list instead */
+static void heap_free_list(int16_t heap_index, void *list) {
+  Heap *heap = heaps + heap_index;
+  if (heap_index == thread_index) {
+    lock_acquire(heap->lock);
+  } else if (lock_try_acquire(heap->lock) != 0) {
+    while (list != NULL) {
+      void *pointer = list;
+      list = *(void **)list;
+      remote_free_push(heap, pointer);
+    }
+    return;
+  }
+  while (list != NULL) {
+    void *pointer = list;
+    list = *(void **)list;
+    heap_release(heap, pointer);
+  }
+  heap_maybe_purge(heap);
   lock_release(heap->lock);
 }
 
-void my_free(void *pointer) {
-  if (global_thread_count < 0)
+void my_free_batch(void **pointers, size_t count) {
+  void *lists[MAX_HEAPS] = {NULL};
+  int16_t first = MAX_HEAPS, last = -1;
+  if (!initialized)
     return;
   init_thread_index();
-  BlockHeader *block = (BlockHeader *)((char *)(pointer)-BLOCK_SIZE);
-  int16_t heap_index = block->heap_index;
-  heap_free(heaps + heap_index, pointer);
+  for (size_t i = 0; i < count; i++) {
+    void *pointer = pointers[i];
+    if (pointer == NULL)
+      continue;
+    PageInfo info = pagemap_get(pointer);
+    if (info.kind == PAGE_KIND_NONE) {
+      fprintf(stderr, "ERROR: Cannot free %p, it was not allocated here\n",
+              pointer);
+      continue;
+    }
+    if (log_is_enabled())
+      log_event(LOG_OP_FREE, pointer, NULL, 0, info.heap_index);
+    if (info.kind == PAGE_KIND_MAPPED) {
+      mapped_free((BlockHeader *)((char *)(pointer)-BLOCK_SIZE));
+    } else if (!tcache_put(pointer, usable_size_of(pointer, info))) {
+      *(void **)pointer = lists[info.heap_index];
+      lists[info.heap_index] = pointer;
+      if (info.heap_index < first)
+        first = info.heap_index;
+      if (info.heap_index > last)
+        last = info.heap_index;
+    }
+  }
+  for (int16_t i = first; i <= last; i++) {
+    if (lists[i] != NULL)
+      heap_free_list(i, lists[i]);
+  }
 }
 
-void *my_realloc(void *pointer, size_t new_size) {
-  BlockHeader *block = (BlockHeader *)((char *)(pointer)-BLOCK_SIZE);
-  if (block->size >= new_size) {
-    return pointer;
+/* Resizes a heap block without moving it, either by giving its tail back
+   to the heap or by absorbing the free block that follows it */
+static int heap_realloc_in_place(BlockHeader *block, size_t new_size) {
+  Heap *heap = heaps + heap_index_of(get_start(block));
+  size_t size = fit_to_memalign(new_size);
+  size_t in_use = block->size;
+  int done = 0;
+  lock_acquire(heap->lock);
+  if (size <= block->size) {
+    size_t old_size = block->size;
+    split_block(heap, block, size);
+    if (block->size != old_size) {
+      BlockHeader *tail = next_block_in_mem(block);
+      if (is_free(tail)) {
+        /* Merge the new tail with a free neighbour */
+        bin_remove(heap, tail);
+        heap_insert_free(heap, tail);
+      }
+    }
+    done = 1;
   } else {
-    my_free(pointer);
+    BlockHeader *block_next = next_block_in_mem(block);
+    if (is_free(block_next) &&
+        block->size + BLOCK_SIZE + block_next->size >= size) {
+      bin_remove(heap, block_next);
+      block->size += block_next->size + BLOCK_SIZE;
+      write_footer(block);
+      split_block(heap, block, size);
+      done = 1;
+    }
+  }
+  heap->counters.in_use_bytes += block->size - in_use;
+  lock_release(heap->lock);
+  return done;
+}
+
+/* Moves to a new block. The realloc is logged before the old memory is
+   released, so that its record comes before the malloc of any thread
+   that gets that memory next */
+static void *realloc_move(void *pointer, PageInfo info, size_t copy_size,
+                          size_t new_size) {
+  void *ret = malloc_internal(MEM_ALIGN, new_size);
+  if (ret != NULL) {
+    memcpy(ret, pointer, copy_size);
+    if (log_is_enabled())
+      log_event(LOG_OP_REALLOC, ret, pointer, new_size, heap_index_of(ret));
+    free_internal(pointer, info);
+  }
+  return ret;
+}
+
+void *my_realloc(void *pointer, size_t new_size) {
+  if (pointer == NULL)
     return my_malloc(new_size);
+  /* Would wrap to a small size and shrink the block in place */
+  if (size_too_large(MEM_ALIGN, new_size))
+    return NULL;
+  BlockHeader *block = (BlockHeader *)((char *)(pointer)-BLOCK_SIZE);
+  PageInfo info = pagemap_get(pointer);
+  void *ret = pointer;
+  if (info.kind == PAGE_KIND_NONE) {
+    fprintf(stderr, "ERROR: Cannot realloc %p, it was not allocated here\n",
+            pointer);
+    return NULL;
+  } else if (info.kind == PAGE_KIND_SLAB) {
+    /* Slab objects keep their size class */
+    size_t old_size = info.object_size;
+    if (new_size > old_size)
+      return realloc_move(pointer, info, old_size, new_size);
+  } else if (info.kind == PAGE_KIND_MAPPED) {
+    if (new_size < mmap_threshold)
+      return realloc_move(pointer, info, new_size, new_size);
+    ret = mapped_realloc(block, new_size);
+  } else if (new_size >= mmap_threshold ||
+             !heap_realloc_in_place(block, new_size)) {
+    size_t old_size = block->size;
+    return realloc_move(pointer, info,
+                        old_size < new_size ? old_size : new_size, new_size);
   }
+  if (ret != NULL && log_is_enabled())
+    log_event(LOG_OP_REALLOC, ret, pointer, new_size, heap_index_of(ret));
+  return ret;
 }
 
-void heap_block_free(HeapHeader *heap) {
-  size_t true_size = heap->size + HEAP_HEADER_SIZE + BLOCK_SIZE;
-  // printf("Dellaloc page %p \n", heap);
-  if (!page_free(heap, true_size)) {
-    fprintf(stderr, "ERROR: Cannot free page at %p of size %zd\n", heap,
-            true_size);
+
+void my_malloc_set_logging(int enabled) { log_set_enabled(enabled); }
+
+void my_malloc_set_mmap_threshold(size_t threshold) {
+  mmap_threshold = threshold;
+}
+
+void my_malloc_set_purge_decay(long decay_ms) { purge_decay_ms = decay_ms; }
+
+void my_malloc_set_numa(int enabled, int fake_nodes) {
+  if (!initialized)
+    my_init();
+  numa_setup(enabled, fake_nodes);
+}
+
+void my_malloc_set_chunk_pool(size_t max_bytes, size_t warm_bytes) {
+  if (!initialized)
+    my_init();
+  chunk_pool_init(max_bytes, warm_bytes);
+}
+
+void my_malloc_set_huge_pages(MyHugePages mode) {
+  switch (mode) {
+  case MY_HUGE_PAGES_ADVISE:
+    huge_pages = PAGE_HUGE_ADVISE;
+    break;
+  case MY_HUGE_PAGES_HUGETLB:
+    huge_pages = PAGE_HUGE_TLB;
+    break;
+  default:
+    huge_pages = PAGE_HUGE_OFF;
+    break;
+  }
+}
+
+static void heap_collect_stats(Heap *heap, MyHeapStats *stats) {
+  HeapCounters *counters = &heap->counters;
+  lock_acquire(heap->lock);
+  stats->mapped_bytes = counters->mapped_bytes;
+  stats->in_use_bytes = counters->in_use_bytes;
+  stats->free_blocks = counters->free_blocks;
+  stats->free_bytes = counters->free_bytes;
+  stats->largest_free_block = 0;
+  if (heap->bin_map != 0) {
+    int bin = floor_log2(heap->bin_map);
+    for (BlockHeader *block = heap->bins[bin].head; block != NULL;
+         block = block->next) {
+      if (block->size > stats->largest_free_block)
+        stats->largest_free_block = block->size;
+    }
+  }
+  lock_release(heap->lock);
+  stats->trylock_failures = counters->trylock_failures;
+  stats->lock_waits = counters->lock_waits;
+  stats->lock_wait_ns = counters->lock_wait_ns;
+  stats->lock_sleeps = lock_sleeps(heap->lock);
+  stats->remote_frees = counters->remote_frees;
+  stats->threads = (size_t)counters->threads;
+}
+
+static void fill_fragmentation(MyHeapStats *stats) {
+  stats->fragmentation =
+      stats->free_bytes == 0
+          ? 0.0
+          : 1.0 - (double)stats->largest_free_block / stats->free_bytes;
+}
+
+size_t my_malloc_stats(MyMallocStats *stats, MyHeapStats *heap_stats,
+                       size_t max_heaps) {
+  *stats = (MyMallocStats){0};
+  if (!initialized)
+    return 0;
+  int16_t count = heap_count;
+  MyHeapStats *total = &stats->total;
+  for (int16_t i = 0; i < count; i++) {
+    MyHeapStats one;
+    heap_collect_stats(heaps + i, &one);
+    fill_fragmentation(&one);
+    if (heap_stats != NULL && (size_t)i < max_heaps)
+      heap_stats[i] = one;
+    total->mapped_bytes += one.mapped_bytes;
+    total->in_use_bytes += one.in_use_bytes;
+    total->free_blocks += one.free_blocks;
+    total->free_bytes += one.free_bytes;
+    if (one.largest_free_block > total->largest_free_block)
+      total->largest_free_block = one.largest_free_block;
+    total->trylock_failures += one.trylock_failures;
+    total->lock_waits += one.lock_waits;
+    total->lock_wait_ns += one.lock_wait_ns;
+    total->lock_sleeps += one.lock_sleeps;
+    total->remote_frees += one.remote_frees;
+    total->threads += one.threads;
   }
+  fill_fragmentation(total);
+  stats->heap_count = (size_t)count;
+  stats->large_mapped_bytes = large_mapped_bytes;
+  stats->large_blocks = large_blocks;
+  stats->pooled_bytes = chunk_pool_bytes();
+  return (size_t)count;
 }
 
 void my_cleanup() {
-  for (int16_t i = 0; i < NUMBER_HEAPS; i++) {
+  heap_generation++;
+  log_flush_all();
+  for (int16_t i = 0; i < heap_count; i++) {
     lock_acquire(heaps[i].lock);
     ddlist_clean(&heaps[i].heap, heap_block_free);
+    heap_span_release(heaps + i, i);
+    slab_heap_release(heaps + i, i);
     heap_init(i);
     lock_release(heaps[i].lock);
   }
+  chunk_pool_release();
 }
\ No newline at end of file
@@ -1,17 +1,111 @@
 #ifndef MYMALLOC_HEADER
 #define MYMALLOC_HEADER
 #include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  /* Memory mapped for heap chunks */
+  size_t mapped_bytes;
+  /* Sizes of allocated blocks, including the ones held in thread caches */
+  size_t in_use_bytes;
+  size_t free_blocks;
+  size_t free_bytes;
+  size_t largest_free_block;
+  /* 1 - largest_free_block / free_bytes */
+  double fragmentation;
+  /* Busy heaps skipped by my_malloc */
+  uint64_t trylock_failures;
+  /* Times my_malloc blocked on a heap lock, and how long it waited */
+  uint64_t lock_waits;
+  uint64_t lock_wait_ns;
+  /* Times a thread slept in the kernel on the heap lock. Only the futex
+     lock counts them, see MYMALLOC_PTHREAD_LOCK */
+  uint64_t lock_sleeps;
+  /* Frees queued on the heap by other threads */
+  uint64_t remote_frees;
+  /* Threads that allocate from the heap */
+  size_t threads;
+} MyHeapStats;
+
+/* Pages backing heap chunks, see my_malloc_set_huge_pages */
+typedef enum {
+  MY_HUGE_PAGES_OFF,
+  /* Transparent huge pages are advised with madvise */
+  MY_HUGE_PAGES_ADVISE,
+  /* Chunks come from the hugetlbfs pool, or normal pages when it is empty */
+  MY_HUGE_PAGES_HUGETLB
+} MyHugePages;
+
+typedef struct {
+  size_t heap_count;
+  /* Sum over heaps. largest_free_block is the largest of any heap */
+  MyHeapStats total;
+  /* Allocations mapped directly from the OS */
+  size_t large_mapped_bytes;
+  size_t large_blocks;
+  /* Released memory kept for reuse, see my_malloc_set_chunk_pool */
+  size_t pooled_bytes;
+} MyMallocStats;
 
 /**   @brief allocates a region of memory
                         @param size size of the memory
 **/
 void *my_malloc(size_t size);
 
+/** @brief allocates a zeroed array
+                        @param count number of elements
+                        @param size size of one element
+                        @return NULL if count * size overflows
+**/
+void *my_calloc(size_t count, size_t size);
+
+/** @brief allocates memory whose address is a multiple of alignment
+                        @param alignment a power of two
+                        @return NULL if alignment is not a power of two
+**/
+void *my_aligned_alloc(size_t alignment, size_t size);
+
+/** @brief usable size of an allocated region, at least the requested size
+**/
+size_t my_malloc_usable_size(void *pointer);
+
 /** @brief free a chunk of memory
                 @param pointer points the the
 **/
 void my_free(void *pointer);
 
+/** @brief allocates count regions of size bytes, taking a heap lock once
+                        @param pointers receives the regions
+                        @return number of regions allocated, less than count
+                        when memory ran out
+**/
+size_t my_malloc_batch(size_t size, size_t count, void **pointers);
+
+/** @brief frees count regions, locking each heap they belong to once.
+    NULL entries are skipped
+**/
+void my_free_batch(void **pointers, size_t count);
+
+/* Bump-pointer allocator for memory that is released all at once. An
+   arena is used by one thread at a time */
+typedef struct MyArena_ MyArena;
+
+/** @brief Create an empty arena, NULL when out of memory */
+MyArena *my_arena_create();
+
+/** @brief Allocate size bytes from the arena, aligned like my_malloc.
+    Arena memory is not passed to my_free, it goes with the arena
+                        @return NULL when out of memory
+**/
+void *my_arena_alloc(MyArena *arena, size_t size);
+
+/** @brief Release everything allocated from the arena at once. Its chunks
+    are kept and filled again by the next allocations */
+void my_arena_reset(MyArena *arena);
+
+/** @brief Give the arena and all its memory back to the OS */
+void my_arena_destroy(MyArena *arena);
+
 /**   @brief reallocates an allocated region to a new size
                         @param size new size of the memory
                         @param old_pointer points to the region of memory
@@ -19,6 +113,55 @@ void my_free(void *pointer);
 **/
 void *my_realloc(void *old_pointer, size_t newsize);
 
+/** @brief Turn allocation logging to LOG_FILE on or off at runtime.
+    Logging is on unless the MYMALLOC_LOG environment variable is "0", and
+    turns itself off when LOG_FILE cannot be opened */
+void my_malloc_set_logging(int enabled);
+
+/** @brief Set the size from which allocations are mapped directly from
+    the OS and unmapped on free. Defaults to MMAP_THRESHOLD or to the
+    MYMALLOC_MMAP_THRESHOLD environment variable */
+void my_malloc_set_mmap_threshold(size_t threshold);
+
+/** @brief Set how long, in milliseconds, large free blocks and empty
+    chunks are kept before their memory is given back to the OS. 0 gives
+    it back right away, a negative value never does. Defaults to
+    PURGE_DECAY_MS or to the MYMALLOC_PURGE_DECAY_MS environment variable */
+void my_malloc_set_purge_decay(long decay_ms);
+
+/** @brief Set how much released memory is kept mapped for heaps and large
+    allocations to reuse, and put warm_bytes of memory whose pages are
+    already faulted in there. Defaults to POOL_MAX_BYTES and no warm
+    memory, or to the MYMALLOC_POOL_MAX and MYMALLOC_POOL_WARM environment
+    variables */
+void my_malloc_set_chunk_pool(size_t max_bytes, size_t warm_bytes);
+
+/** @brief Choose the pages of heap chunks mapped from now on. Defaults to
+    MY_HUGE_PAGES_OFF or to the MYMALLOC_HUGE_PAGES environment variable,
+    0 for off, 1 to advise transparent huge pages and 2 for hugetlbfs */
+void my_malloc_set_huge_pages(MyHugePages mode);
+
+/** @brief Turn NUMA placement on or off. With it heaps are grouped by
+    node, threads take a heap of the node they run on and heap memory
+    prefers that node. fake_nodes > 0 stands for a machine with that many
+    nodes over equal runs of CPUs, to try the placement on any machine.
+    Threads that already have a heap keep it. Placement stays off when
+    the heaps in use cannot be spread evenly over the nodes within
+    MAX_HEAPS. Defaults to off, or to on
+    when the MYMALLOC_NUMA environment variable is "1" or
+    MYMALLOC_NUMA_NODES gives fake_nodes */
+void my_malloc_set_numa(int enabled, int fake_nodes);
+
+/** @brief Snapshot the allocator counters. Each heap is locked briefly in
+    turn, so this is cheap enough to be called periodically
+                        @param stats receives the totals
+                        @param heap_stats receives per-heap counters or is NULL
+                        @param max_heaps size of heap_stats
+                        @return number of heaps in use
+**/
+size_t my_malloc_stats(MyMallocStats *stats, MyHeapStats *heap_stats,
+                       size_t max_heaps);
+
 /** @brief Release all memory and reset state */
 void my_cleanup();
 
@@ -4,10 +4,24 @@
 #include "dllist.h"
 #include "lock.h"
 
-#define MEM_ALIGN 8
+/* Matches the alignment of max_align_t on x86-64 */
+#define MEM_ALIGN 16
 
-#define PAGE_MIN_SIZE 4096
-#define PAGE_DIV 4096
+#define PAGE_SHIFT 12
+#define PAGE_DIV (1 << PAGE_SHIFT)
+
+/* Heaps grow by CHUNK_ALIGN multiples, the huge page size. The first
+   growth of a heap is CHUNK_MIN_SIZE bytes and each next one twice the one
+   before, up to CHUNK_MAX_SIZE, unless the request needs more */
+#define CHUNK_ALIGN ((size_t)2 << 20)
+#define CHUNK_MIN_SIZE CHUNK_ALIGN
+#define CHUNK_MAX_SIZE ((size_t)64 << 20)
+
+/* Heap blocks live in one reserved region where every heap owns HEAP_SPAN
+   bytes, a single chunk committed upwards as the heap grows. The heap of
+   a block is known from its address. Heaps fall back to separately mapped
+   chunks once their span is used up or when it could not be reserved */
+#define HEAP_SPAN ((size_t)4 << 30)
 
 #define HEAP_HEADER_SIZE                                                       \
   (MEM_ALIGN * ((sizeof(HeapHeader) + MEM_ALIGN - 1) / MEM_ALIGN))
@@ -15,19 +29,154 @@
 #define BLOCK_SIZE                                                             \
   (MEM_ALIGN * ((sizeof(BlockHeader) + MEM_ALIGN - 1) / MEM_ALIGN))
 
-#define NUMBER_HEAPS 8
+/* One heap per CPU is used at first, more are added up to MAX_HEAPS
+   when every heap is busy */
+#define MAX_HEAPS 128
+
+/* Lock attempts on a busy heap before blocking on it */
+#define HEAP_SPIN_TRIES 64
+
+/* Free blocks are segregated into size classes: sizes below
+   BIN_LINEAR_LIMIT get one bin per MEM_ALIGN step, larger sizes get
+   BIN_SUB_COUNT bins per power of two. The last bin holds everything
+   above the largest class and is searched first-fit. */
+#define BIN_SUB_LOG2 2
+#define BIN_SUB_COUNT (1 << BIN_SUB_LOG2)
+#define BIN_LINEAR_LIMIT (MEM_ALIGN * BIN_SUB_COUNT)
+#define NUMBER_BINS 64
+
+/* Freed blocks up to TCACHE_MAX_SIZE bytes are kept in a per-thread
+   cache, TCACHE_BIN_CAPACITY per size, before going back to their heap */
+#define TCACHE_MAX_SIZE 256
+#define TCACHE_BINS (TCACHE_MAX_SIZE / MEM_ALIGN + 1)
+#define TCACHE_BIN_CAPACITY 32
+
+/* Requests up to SLAB_MAX_SIZE bytes are served from slabs: SLAB_SIZE
+   aligned runs of same-sized objects without a header of their own.
+   Slabs are carved from one reserved region where every heap owns
+   SLAB_HEAP_SPAN bytes, so a pointer is known to be a slab object by its
+   address */
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASSES (SLAB_MAX_SIZE / MEM_ALIGN + 1)
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_HEAP_SPAN ((size_t)256 << 20)
+
+/* Released chunks and large mappings of up to POOL_MAX_CHUNK_SIZE bytes
+   are kept in the chunk pool, POOL_SLOTS of them per power of two of
+   pages, for heaps and large allocations to take before mapping memory.
+   The pool holds up to POOL_MAX_BYTES */
+#define POOL_SLOTS 16
+#define POOL_MAX_CHUNK_SIZE ((size_t)64 << 20)
+#define POOL_MAX_BYTES ((size_t)64 << 20)
+
+/* Arenas start with one ARENA_CHUNK_SIZE chunk, each chunk they add is
+   twice the size of the one before, up to ARENA_CHUNK_MAX_SIZE */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_CHUNK_MAX_SIZE ((size_t)4 << 20)
 
 #define LOG_FILE "my_malloc.log"
 
-typedef enum { MY_BLOCK_OCCUPIED = 1 } MyBlockFlag;
+/* Requests of at least MMAP_THRESHOLD bytes get their own mapping */
+#define MMAP_THRESHOLD (128 * 1024)
+
+/* Free blocks of at least PURGE_MIN_SIZE bytes have their inner pages
+   given back to the OS once they stayed free for PURGE_DECAY_MS, and
+   fully free chunks beyond RETAIN_EMPTY_CHUNKS per heap are unmapped */
+#define PURGE_MIN_SIZE (64 * 1024)
+#define PURGE_DECAY_MS 1000
+#define RETAIN_EMPTY_CHUNKS 1
+
+/* Heap blocks carry the footer of the block before them in memory, its
+   size ORed with its FOOTER_FLAGS. A chunk starts with a footer flagged
+   MY_BLOCK_FENCE and ends with a fence block, so that merging stops at
+   both ends. A MY_BLOCK_MAPPED block has heap_index -1 and its
+   previous_footer holds its offset from the start of its mapping.
+   MY_BLOCK_PURGED marks a free block whose inner pages were given back */
+typedef enum {
+  MY_BLOCK_OCCUPIED = 1,
+  MY_BLOCK_MAPPED = 2,
+  MY_BLOCK_FENCE = 4,
+  MY_BLOCK_PURGED = 8,
+  /* A MY_BLOCK_MAPPED block whose mapping came from the chunk pool, so it
+     is not zeroed */
+  MY_BLOCK_POOLED = 16
+} MyBlockFlag;
+
+#define FOOTER_FLAGS (MY_BLOCK_OCCUPIED | MY_BLOCK_FENCE)
+#define FOOTER_SIZE_MASK (~(size_t)(MEM_ALIGN - 1))
 
 typedef DLLElement HeapHeader;
 typedef DLLElement BlockHeader;
 
+/* Starts every slab. A slab with free objects is linked in the list of
+   its size class, a slab without used objects in the empty list */
+typedef struct Slab_ {
+  struct Slab_ *next, *previous;
+  /* Freed objects, linked through their first word */
+  void *free;
+  /* Objects from here on were never handed out */
+  char *unused;
+  uint32_t object_size;
+  uint32_t used;
+  int16_t heap_index;
+  int8_t purged;
+} Slab;
+
+#define SLAB_HEADER_SIZE                                                       \
+  (MEM_ALIGN * ((sizeof(Slab) + MEM_ALIGN - 1) / MEM_ALIGN))
+
+/* Plain fields change under the heap lock, atomic ones are bumped with
+   relaxed ordering from outside of it */
+typedef struct {
+  size_t mapped_bytes;
+  size_t in_use_bytes;
+  size_t free_blocks;
+  size_t free_bytes;
+  _Atomic uint64_t trylock_failures;
+  _Atomic uint64_t lock_waits;
+  _Atomic uint64_t lock_wait_ns;
+  _Atomic uint64_t remote_frees;
+  /* Threads whose heap this is, kept across my_cleanup */
+  _Atomic int32_t threads;
+} HeapCounters;
+
 typedef struct {
   DLList heap;
-  DLList free_list;
+  DLList bins[NUMBER_BINS];
+  uint64_t bin_map;
+  /* Time after which heap_purge runs, 0 when nothing waits for it */
+  uint64_t purge_deadline;
+  /* Memory freed by other threads, linked through its first word,
+     waiting for the next allocation on this heap to take it back */
+  _Atomic(void *) remote_free;
+  Slab *slabs[SLAB_CLASSES];
+  Slab *empty_slabs;
+  /* Part of the heap's slab span that was never committed */
+  char *slab_top;
+  char *slab_end;
+  /* Part of the heap's span that was never committed */
+  char *block_top;
+  char *block_end;
+  /* Size of the next growth */
+  size_t chunk_size;
+  HeapCounters counters;
   Lock lock;
 } Heap;
 
+/* Cached memory is linked through its first word */
+typedef struct {
+  void *bins[TCACHE_BINS];
+  uint16_t counts[TCACHE_BINS];
+  unsigned generation;
+} ThreadCache;
+
+static inline size_t fit_to_memalign(size_t size) {
+  return (MEM_ALIGN * ((size + MEM_ALIGN - 1) / MEM_ALIGN));
+}
+
+extern _Thread_local int16_t thread_index;
+
+/** @brief Return the blocks cached by the calling thread to their heaps */
+void tcache_flush();
+
 #endif /*MYMALLOC_INTERNAL_HEADER*/
\ No newline at end of file
@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+#include "numa.h"
+#include "page_alloc.h"
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int numa_nodes = 1;
+static int numa_fake = 0;
+static int numa_cpus = 1;
+
+/* Nodes the kernel knows of, from a list such as "0-3". Read without
+   stdio, which would allocate */
+static int numa_system_nodes() {
+  char buffer[64];
+  int fd = open("/sys/devices/system/node/possible", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 1;
+  ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (length <= 0)
+    return 1;
+  buffer[length] = '\0';
+  /* The last number of the list is the highest node */
+  char *last = buffer;
+  for (char *c = buffer; *c != '\0'; c++) {
+    if ((*c == '-' || *c == ',') && c[1] != '\0')
+      last = c + 1;
+  }
+  long highest = strtol(last, NULL, 10);
+  return highest < 0 ? 1 : (int)highest + 1;
+}
+
+void numa_configure(int enabled, int fake_nodes) {
+  long cpus = sysconf(_SC_NPROCESSORS_CONF);
+  numa_cpus = cpus < 1 ? 1 : (int)cpus;
+  numa_fake = enabled && fake_nodes > 0;
+  if (!enabled)
+    numa_nodes = 1;
+  else if (numa_fake)
+    numa_nodes = fake_nodes;
+  else
+    numa_nodes = numa_system_nodes();
+}
+
+int numa_getcpu(int *node) {
+  unsigned cpu = 0, cpu_node = 0;
+#ifdef SYS_getcpu
+  if (syscall(SYS_getcpu, &cpu, &cpu_node, NULL) != 0) {
+    *node = 0;
+    return -1;
+  }
+#else
+  int current = sched_getcpu();
+  if (current < 0) {
+    *node = 0;
+    return -1;
+  }
+  cpu = (unsigned)current;
+#endif
+  if (numa_fake)
+    cpu_node = (unsigned)((unsigned long)cpu * numa_nodes / numa_cpus);
+  *node = (int)(cpu_node % (unsigned)numa_nodes);
+  return (int)cpu;
+}
+
+void numa_bind(void *pointer, size_t size, int node) {
+  if (numa_nodes > 1 && !numa_fake)
+    page_bind(pointer, size, node);
+}
@@ -0,0 +1,21 @@
+#ifndef NUMA_HEADER
+#define NUMA_HEADER
+#include <stddef.h>
+
+/* NUMA nodes the heaps are grouped by, 1 while NUMA placement is off.
+   Heap h serves node h % numa_nodes */
+extern int numa_nodes;
+
+/** @brief Turn NUMA placement on with the nodes of the machine, or off.
+    With fake_nodes > 0 the machine is taken to have that many nodes, each
+    owning an equal run of the CPUs, and no memory is bound */
+void numa_configure(int enabled, int fake_nodes);
+
+/** @brief CPU the calling thread runs on, -1 if unknown. Its node, always
+    below numa_nodes, goes to *node */
+int numa_getcpu(int *node);
+
+/** @brief Prefer node for the pages of a region not touched yet */
+void numa_bind(void *pointer, size_t size, int node);
+
+#endif /*NUMA_HEADER*/
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include "page_alloc.h"
+#include <string.h>
 
 #ifdef WIN32
 #include <memoryapi.h>
@@ -9,18 +11,71 @@ void *page_alloc(size_t size) {
   return mem;
 }
 
+void *page_alloc_aligned(size_t size, size_t alignment, PageHugeMode huge) {
+  /* Find an aligned address in a larger reservation, then map exactly
+     there. Another thread may take it in between, so retry a few times */
+  for (int tries = 0; tries < 8; tries++) {
+    char *mem = (char *)VirtualAlloc(NULL, size + alignment, MEM_RESERVE,
+                                     PAGE_NOACCESS);
+    if (mem == NULL)
+      return NULL;
+    char *aligned = (char *)(((size_t)mem + alignment - 1) & ~(alignment - 1));
+    VirtualFree(mem, 0, MEM_RELEASE);
+    mem = (char *)VirtualAlloc(aligned, size, MEM_RESERVE | MEM_COMMIT,
+                               PAGE_READWRITE);
+    if (mem != NULL)
+      return mem;
+  }
+  return NULL;
+}
+
+void *page_alloc_hugetlb(size_t size, size_t alignment) { return NULL; }
+
 int page_free(void *pointer, size_t size) {
   return VirtualFree(pointer, 0, MEM_RELEASE);
 }
 
+int page_purge(void *pointer, size_t size) {
+  return VirtualAlloc(pointer, size, MEM_RESET, PAGE_READWRITE) != NULL;
+}
+
+void *page_realloc(void *pointer, size_t old_size, size_t new_size) {
+  void *mem = page_alloc(new_size);
+  if (mem != NULL) {
+    memcpy(mem, pointer, old_size < new_size ? old_size : new_size);
+    page_free(pointer, old_size);
+  }
+  return mem;
+}
+
+void *page_reserve(size_t size) {
+  return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+int page_commit(void *pointer, size_t size) {
+  return VirtualAlloc(pointer, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+}
+
+int page_decommit(void *pointer, size_t size) {
+  return VirtualFree(pointer, size, MEM_DECOMMIT);
+}
+
+int page_move(void *from, void *to, size_t size) { return 0; }
+
+void page_advise_huge(void *pointer, size_t size) {}
+
+int page_bind(void *pointer, size_t size, int node) { return 0; }
+
 #else
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 /*TODO: DEBUG*/
 #include <stdlib.h>
 
 void *page_alloc(size_t size) {
   void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
-                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_STACK, -1, 0);
+                   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
   if (mem == MAP_FAILED) {
     return NULL;
   } else {
@@ -28,5 +83,107 @@ void *page_alloc(size_t size) {
   }
 }
 
+void *page_alloc_hugetlb(size_t size, size_t alignment) {
+#ifdef MAP_HUGETLB
+  /* Huge pages are aligned to their size */
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+  if (mem != MAP_FAILED && ((size_t)mem & (alignment - 1)) == 0)
+    return mem;
+  if (mem != MAP_FAILED)
+    munmap(mem, size);
+#endif
+  return NULL;
+}
+
+void *page_alloc_aligned(size_t size, size_t alignment, PageHugeMode huge) {
+  if (huge == PAGE_HUGE_TLB) {
+    void *mem = page_alloc_hugetlb(size, alignment);
+    if (mem != NULL)
+      return mem;
+  }
+  /* Map alignment more bytes than needed and unmap what lies outside of
+     the aligned range */
+  char *mem = (char *)page_alloc(size + alignment);
+  if (mem == NULL)
+    return NULL;
+  char *aligned = (char *)(((size_t)mem + alignment - 1) & ~(alignment - 1));
+  if (aligned > mem)
+    munmap(mem, (size_t)(aligned - mem));
+  munmap(aligned + size, (size_t)(mem + alignment - aligned));
+  if (huge != PAGE_HUGE_OFF)
+    page_advise_huge(aligned, size);
+  return aligned;
+}
+
 int page_free(void *pointer, size_t size) { return munmap(pointer, size) == 0; }
+
+int page_purge(void *pointer, size_t size) {
+  return madvise(pointer, size, MADV_DONTNEED) == 0;
+}
+
+void *page_realloc(void *pointer, size_t old_size, size_t new_size) {
+#ifdef MREMAP_MAYMOVE
+  void *mem = mremap(pointer, old_size, new_size, MREMAP_MAYMOVE);
+  if (mem == MAP_FAILED) {
+    return NULL;
+  }
+#else
+  void *mem = page_alloc(new_size);
+  if (mem != NULL) {
+    memcpy(mem, pointer, old_size < new_size ? old_size : new_size);
+    page_free(pointer, old_size);
+  }
+#endif
+  return mem;
+}
+
+void *page_reserve(size_t size) {
+  void *mem = mmap(NULL, size, PROT_NONE,
+                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+  return mem == MAP_FAILED ? NULL : mem;
+}
+
+int page_commit(void *pointer, size_t size) {
+  return mprotect(pointer, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+int page_decommit(void *pointer, size_t size) {
+  /* Mapping over the range drops its pages and its commit charge */
+  return mmap(pointer, size, PROT_NONE,
+              MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, -1,
+              0) != MAP_FAILED;
+}
+
+int page_move(void *from, void *to, size_t size) {
+#ifdef MREMAP_FIXED
+  return mremap(from, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, to) !=
+         MAP_FAILED;
+#else
+  return 0;
+#endif
+}
+
+void page_advise_huge(void *pointer, size_t size) {
+#ifdef MADV_HUGEPAGE
+  madvise(pointer, size, MADV_HUGEPAGE);
+#endif
+}
+
+int page_bind(void *pointer, size_t size, int node) {
+#ifdef SYS_mbind
+  /* From <numaif.h>, which comes with libnuma */
+  const int mpol_preferred = 1;
+  unsigned long mask[4] = {0};
+  const unsigned long bits = 8 * sizeof(unsigned long);
+  if (node < 0 || (unsigned long)node >= 8 * sizeof(mask))
+    return 0;
+  mask[node / bits] = 1UL << (node % bits);
+  /* The kernel reads one bit less than maxnode */
+  return syscall(SYS_mbind, pointer, size, mpol_preferred, mask,
+                 8 * sizeof(mask) + 1, 0) == 0;
+#else
+  return 0;
+#endif
+}
 #endif
\ No newline at end of file
@@ -2,8 +2,55 @@
 #define PAGE_ALLOC_HEADER
 #include <stddef.h>
 
+/* How page_alloc_aligned backs a region: with normal pages, with normal
+   pages that transparent huge pages are advised for, or from the
+   hugetlbfs pool */
+typedef enum { PAGE_HUGE_OFF, PAGE_HUGE_ADVISE, PAGE_HUGE_TLB } PageHugeMode;
+
 void *page_alloc(size_t size);
 
+/** @brief Map size bytes at a multiple of alignment, a power of two
+    multiple of the page size. With PAGE_HUGE_TLB size must be a multiple
+    of the huge page size; when the pool is empty normal pages are used */
+void *page_alloc_aligned(size_t size, size_t alignment, PageHugeMode huge);
+
+/** @brief Map size bytes from the hugetlbfs pool at a multiple of
+    alignment. Such regions can be neither split nor moved
+                        @return NULL when the pool cannot serve them
+**/
+void *page_alloc_hugetlb(size_t size, size_t alignment);
+
 int page_free(void *pointer, size_t size);
 
+/** @brief Give the physical pages of a region back to the OS, keeping the
+    region mapped. Its contents become undefined */
+int page_purge(void *pointer, size_t size);
+
+/** @brief Resize a region from page_alloc, moving it if needed. Contents
+    are kept up to the smaller size. Returns NULL and leaves the region
+    alone on failure */
+void *page_realloc(void *pointer, size_t old_size, size_t new_size);
+
+/** @brief Reserve address space without backing it. Pages are
+    inaccessible until page_commit */
+void *page_reserve(size_t size);
+
+/** @brief Make pages of a reservation usable, returns 1 on success */
+int page_commit(void *pointer, size_t size);
+
+/** @brief Give committed pages back, leaving them reserved */
+int page_decommit(void *pointer, size_t size);
+
+/** @brief Move the pages of a region from page_alloc over the range at
+    to, which may be reserved, keeping their contents. Returns 1 on
+    success and 0, leaving both alone, where pages cannot be moved */
+int page_move(void *from, void *to, size_t size);
+
+/** @brief Advise transparent huge pages for a region, where supported */
+void page_advise_huge(void *pointer, size_t size);
+
+/** @brief Prefer a NUMA node for the pages of a region faulted in from
+    now on, returns 1 on success */
+int page_bind(void *pointer, size_t size, int node);
+
 #endif /*PAGE_ALLOC_HEADER*/
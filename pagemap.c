@@ -0,0 +1,83 @@
+#include "pagemap.h"
+#include "page_alloc.h"
+
+_Atomic(PageMapNode *) pagemap_root[PAGEMAP_LEVEL_SIZE];
+
+/* Returns the node from slot, installing a zeroed one of size bytes if
+   there is none. Racing threads agree on whichever got there first */
+static void *pagemap_node(_Atomic(void *) *slot, size_t size) {
+  void *node = atomic_load_explicit(slot, memory_order_acquire);
+  if (node != NULL)
+    return node;
+  /* Fresh mappings are zeroed */
+  void *fresh = page_alloc(size);
+  if (fresh == NULL)
+    return NULL;
+  if (atomic_compare_exchange_strong_explicit(slot, &node, fresh,
+                                              memory_order_acq_rel,
+                                              memory_order_acquire)) {
+    return fresh;
+  }
+  page_free(fresh, size);
+  return node;
+}
+
+static PageMapLeaf *pagemap_leaf(size_t page) {
+  PageMapNode *node = (PageMapNode *)pagemap_node(
+      (_Atomic(void *) *)(pagemap_root + (page >> (2 * PAGEMAP_LEVEL_BITS))),
+      sizeof(PageMapNode));
+  if (node == NULL)
+    return NULL;
+  return (PageMapLeaf *)pagemap_node(
+      (_Atomic(void *) *)(node->leaves + ((page >> PAGEMAP_LEVEL_BITS) &
+                                          (PAGEMAP_LEVEL_SIZE - 1))),
+      sizeof(PageMapLeaf));
+}
+
+int pagemap_set(void *start, size_t size, PageInfo info) {
+  size_t page = (size_t)start >> PAGE_SHIFT;
+  size_t end = ((size_t)start + size + PAGE_DIV - 1) >> PAGE_SHIFT;
+  if (end > (size_t)1 << (PAGEMAP_ADDRESS_BITS - PAGE_SHIFT))
+    return 0;
+  while (page < end) {
+    PageMapLeaf *leaf = pagemap_leaf(page);
+    if (leaf == NULL)
+      return 0;
+    /* Fill the rest of the leaf in one go */
+    size_t index = page & (PAGEMAP_LEVEL_SIZE - 1);
+    size_t count = PAGEMAP_LEVEL_SIZE - index;
+    if (count > end - page)
+      count = end - page;
+    for (size_t i = 0; i < count; i++) {
+      leaf->pages[index + i] = info;
+    }
+    page += count;
+  }
+  return 1;
+}
+
+void pagemap_clear(void *start, size_t size) {
+  PageInfo none = {0, -1, PAGE_KIND_NONE, 0};
+  size_t page = (size_t)start >> PAGE_SHIFT;
+  size_t end = ((size_t)start + size + PAGE_DIV - 1) >> PAGE_SHIFT;
+  while (page < end) {
+    size_t index = page & (PAGEMAP_LEVEL_SIZE - 1);
+    size_t count = PAGEMAP_LEVEL_SIZE - index;
+    if (count > end - page)
+      count = end - page;
+    /* Leaves that were never allocated describe nothing already */
+    PageMapNode *node = atomic_load_explicit(
+        pagemap_root + (page >> (2 * PAGEMAP_LEVEL_BITS)),
+        memory_order_acquire);
+    PageMapLeaf *leaf =
+        node == NULL ? NULL
+                     : atomic_load_explicit(
+                           node->leaves + ((page >> PAGEMAP_LEVEL_BITS) &
+                                           (PAGEMAP_LEVEL_SIZE - 1)),
+                           memory_order_acquire);
+    for (size_t i = 0; leaf != NULL && i < count; i++) {
+      leaf->pages[index + i] = none;
+    }
+    page += count;
+  }
+}
@@ -0,0 +1,73 @@
+#ifndef PAGEMAP_HEADER
+#define PAGEMAP_HEADER
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mymalloc_internal.h"
+
+/* What a page handed out by the allocator holds */
+typedef enum {
+  /* Not the allocator's */
+  PAGE_KIND_NONE = 0,
+  PAGE_KIND_SLAB,
+  PAGE_KIND_HEAP,
+  /* The page a MY_BLOCK_MAPPED block's pointer is in */
+  PAGE_KIND_MAPPED
+} PageKind;
+
+typedef struct {
+  /* Object size of a slab page, 0 otherwise */
+  uint32_t object_size;
+  /* Owning heap, -1 for mapped blocks */
+  int16_t heap_index;
+  uint8_t kind;
+  /* 1 for the pages of a heap chunk mapped from the hugetlbfs pool */
+  uint8_t hugetlb;
+} PageInfo;
+
+/* The page map is a radix tree over the 48-bit address space, one level
+   of PAGEMAP_LEVEL_BITS of the page number each. Nodes are allocated on
+   first use and never freed, so lookups take no lock */
+#define PAGEMAP_LEVEL_BITS 12
+#define PAGEMAP_LEVEL_SIZE (1 << PAGEMAP_LEVEL_BITS)
+#define PAGEMAP_ADDRESS_BITS 48
+
+typedef struct {
+  PageInfo pages[PAGEMAP_LEVEL_SIZE];
+} PageMapLeaf;
+
+typedef struct {
+  _Atomic(PageMapLeaf *) leaves[PAGEMAP_LEVEL_SIZE];
+} PageMapNode;
+
+extern _Atomic(PageMapNode *) pagemap_root[PAGEMAP_LEVEL_SIZE];
+
+/** @brief Descriptor of the page pointer is in, kind PAGE_KIND_NONE for
+    pages the allocator did not describe */
+static inline PageInfo pagemap_get(void *pointer) {
+  PageInfo none = {0, -1, PAGE_KIND_NONE, 0};
+  size_t page = (size_t)pointer >> PAGE_SHIFT;
+  if (page >> (2 * PAGEMAP_LEVEL_BITS) >= PAGEMAP_LEVEL_SIZE)
+    return none;
+  PageMapNode *node =
+      atomic_load_explicit(pagemap_root + (page >> (2 * PAGEMAP_LEVEL_BITS)),
+                           memory_order_acquire);
+  if (node == NULL)
+    return none;
+  PageMapLeaf *leaf = atomic_load_explicit(
+      node->leaves + ((page >> PAGEMAP_LEVEL_BITS) & (PAGEMAP_LEVEL_SIZE - 1)),
+      memory_order_acquire);
+  if (leaf == NULL)
+    return none;
+  return leaf->pages[page & (PAGEMAP_LEVEL_SIZE - 1)];
+}
+
+/** @brief Describe every page of a region, returns 0 when a node of the
+    map could not be allocated */
+int pagemap_set(void *start, size_t size, PageInfo info);
+
+/** @brief Forget the pages of a region */
+void pagemap_clear(void *start, size_t size);
+
+#endif /*PAGEMAP_HEADER*/
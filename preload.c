@@ -0,0 +1,145 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mymalloc.h"
+#include "mymalloc_internal.h"
+
+/* Allocations made while the allocator is already running on this thread,
+   e.g. by libc functions it calls during my_init, are served from a
+   static buffer and never freed */
+#define BOOTSTRAP_SIZE (64 * 1024)
+#define BOOTSTRAP_ALIGN 16
+
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(BOOTSTRAP_ALIGN)));
+static atomic_size_t bootstrap_used = 0;
+static _Thread_local int depth = 0;
+
+static int is_bootstrap(void *pointer) {
+  return (char *)pointer >= bootstrap &&
+         (char *)pointer < bootstrap + BOOTSTRAP_SIZE;
+}
+
+/* Each bootstrap allocation is preceded by its size */
+static void *bootstrap_alloc(size_t size) {
+  size_t needed =
+      BOOTSTRAP_ALIGN + (size + BOOTSTRAP_ALIGN - 1) / BOOTSTRAP_ALIGN *
+                            BOOTSTRAP_ALIGN;
+  size_t offset = atomic_fetch_add(&bootstrap_used, needed);
+  if (size > BOOTSTRAP_SIZE || offset + needed > BOOTSTRAP_SIZE)
+    return NULL;
+  *(size_t *)(bootstrap + offset) = size;
+  return bootstrap + offset + BOOTSTRAP_ALIGN;
+}
+
+static size_t bootstrap_size(void *pointer) {
+  return *(size_t *)((char *)pointer - BOOTSTRAP_ALIGN);
+}
+
+void *malloc(size_t size) {
+  if (depth)
+    return bootstrap_alloc(size);
+  depth++;
+  void *ret = my_malloc(size);
+  depth--;
+  if (ret == NULL)
+    errno = ENOMEM;
+  return ret;
+}
+
+void free(void *pointer) {
+  if (pointer == NULL || is_bootstrap(pointer))
+    return;
+  depth++;
+  my_free(pointer);
+  depth--;
+}
+
+void *calloc(size_t count, size_t size) {
+  if (depth) {
+    if (size != 0 && count > SIZE_MAX / size)
+      return NULL;
+    /* The static buffer starts zeroed and is never reused */
+    return bootstrap_alloc(count * size);
+  }
+  depth++;
+  void *ret = my_calloc(count, size);
+  depth--;
+  if (ret == NULL)
+    errno = ENOMEM;
+  return ret;
+}
+
+void *realloc(void *pointer, size_t size) {
+  if (pointer != NULL && size == 0) {
+    free(pointer);
+    return NULL;
+  }
+  if (pointer != NULL && is_bootstrap(pointer)) {
+    void *ret = malloc(size);
+    if (ret != NULL) {
+      size_t old_size = bootstrap_size(pointer);
+      memcpy(ret, pointer, old_size < size ? old_size : size);
+    }
+    return ret;
+  }
+  if (depth)
+    return pointer == NULL ? bootstrap_alloc(size) : NULL;
+  depth++;
+  void *ret = my_realloc(pointer, size);
+  depth--;
+  if (ret == NULL)
+    errno = ENOMEM;
+  return ret;
+}
+
+static void *aligned(size_t alignment, size_t size) {
+  if (alignment <= MEM_ALIGN)
+    return malloc(size);
+  if (depth)
+    return alignment <= BOOTSTRAP_ALIGN ? bootstrap_alloc(size) : NULL;
+  depth++;
+  void *ret = my_aligned_alloc(alignment, size);
+  depth--;
+  return ret;
+}
+
+int posix_memalign(void **pointer, size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0 ||
+      alignment % sizeof(void *) != 0)
+    return EINVAL;
+  void *ret = aligned(alignment, size);
+  if (ret == NULL)
+    return ENOMEM;
+  *pointer = ret;
+  return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  void *ret = aligned(alignment, size);
+  if (ret == NULL)
+    errno = ENOMEM;
+  return ret;
+}
+
+void *memalign(size_t alignment, size_t size) {
+  return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size) { return aligned_alloc(PAGE_DIV, size); }
+
+void *pvalloc(size_t size) {
+  return aligned_alloc(PAGE_DIV, (size + PAGE_DIV - 1) / PAGE_DIV * PAGE_DIV);
+}
+
+size_t malloc_usable_size(void *pointer) {
+  if (pointer != NULL && is_bootstrap(pointer))
+    return bootstrap_size(pointer);
+  return my_malloc_usable_size(pointer);
+}
@@ -0,0 +1,136 @@
+#include "slab.h"
+#include "numa.h"
+#include "page_alloc.h"
+#include "pagemap.h"
+
+char *slab_region_start = NULL;
+char *slab_region_end = NULL;
+
+void slab_region_init() {
+  size_t size = (size_t)MAX_HEAPS * SLAB_HEAP_SPAN;
+  /* One more slab to align the start on SLAB_SIZE */
+  char *region = (char *)page_reserve(size + SLAB_SIZE);
+  if (region == NULL)
+    return;
+  slab_region_start =
+      (char *)(((size_t)region + SLAB_SIZE - 1) & ~((size_t)SLAB_SIZE - 1));
+  slab_region_end = slab_region_start + size;
+}
+
+void slab_heap_init(Heap *heap, int16_t heap_index) {
+  if (slab_region_start == NULL)
+    return;
+  heap->slab_top = slab_region_start + (size_t)heap_index * SLAB_HEAP_SPAN;
+  heap->slab_end = heap->slab_top + SLAB_HEAP_SPAN;
+}
+
+void slab_heap_release(Heap *heap, int16_t heap_index) {
+  if (slab_region_start == NULL)
+    return;
+  char *start = slab_region_start + (size_t)heap_index * SLAB_HEAP_SPAN;
+  if (heap->slab_top > start) {
+    pagemap_clear(start, (size_t)(heap->slab_top - start));
+    page_decommit(start, (size_t)(heap->slab_top - start));
+  }
+}
+
+static int slab_is_full(Slab *slab) {
+  return slab->free == NULL &&
+         slab->unused + slab->object_size > (char *)slab + SLAB_SIZE;
+}
+
+static void slab_list_push(Slab **list, Slab *slab) {
+  slab->previous = NULL;
+  slab->next = *list;
+  if (*list != NULL)
+    (*list)->previous = slab;
+  *list = slab;
+}
+
+static void slab_list_remove(Slab **list, Slab *slab) {
+  if (slab->previous != NULL)
+    slab->previous->next = slab->next;
+  else
+    *list = slab->next;
+  if (slab->next != NULL)
+    slab->next->previous = slab->previous;
+}
+
+static Slab *slab_new(Heap *heap, int16_t heap_index, size_t object_size) {
+  Slab *slab = heap->empty_slabs;
+  PageInfo info = {(uint32_t)object_size, heap_index, PAGE_KIND_SLAB, 0};
+  if (slab != NULL) {
+    /* The slab may change size class */
+    if (!pagemap_set(slab, SLAB_SIZE, info))
+      return NULL;
+    slab_list_remove(&heap->empty_slabs, slab);
+  } else {
+    if (heap->slab_top == heap->slab_end ||
+        !pagemap_set(heap->slab_top, SLAB_SIZE, info) ||
+        !page_commit(heap->slab_top, SLAB_SIZE))
+      return NULL;
+    numa_bind(heap->slab_top, SLAB_SIZE, heap_index % numa_nodes);
+    slab = (Slab *)heap->slab_top;
+    heap->slab_top += SLAB_SIZE;
+    heap->counters.mapped_bytes += SLAB_SIZE;
+  }
+  slab->free = NULL;
+  slab->unused = (char *)slab + SLAB_HEADER_SIZE;
+  slab->object_size = (uint32_t)object_size;
+  slab->used = 0;
+  slab->heap_index = heap_index;
+  slab->purged = 0;
+  return slab;
+}
+
+void *slab_alloc(Heap *heap, int16_t heap_index, size_t size) {
+  size_t object_size = size == 0 ? MEM_ALIGN : fit_to_memalign(size);
+  Slab **list = heap->slabs + object_size / MEM_ALIGN;
+  Slab *slab = *list;
+  if (slab == NULL) {
+    slab = slab_new(heap, heap_index, object_size);
+    if (slab == NULL)
+      return NULL;
+    slab_list_push(list, slab);
+  }
+  void *object = slab->free;
+  if (object != NULL) {
+    slab->free = *(void **)object;
+  } else {
+    object = slab->unused;
+    slab->unused += object_size;
+  }
+  slab->used++;
+  if (slab_is_full(slab))
+    slab_list_remove(list, slab);
+  heap->counters.in_use_bytes += object_size;
+  return object;
+}
+
+int slab_free(Heap *heap, void *pointer) {
+  Slab *slab = slab_of(pointer);
+  Slab **list = heap->slabs + slab->object_size / MEM_ALIGN;
+  int was_full = slab_is_full(slab);
+  *(void **)pointer = slab->free;
+  slab->free = pointer;
+  slab->used--;
+  heap->counters.in_use_bytes -= slab->object_size;
+  if (slab->used == 0) {
+    if (!was_full)
+      slab_list_remove(list, slab);
+    slab_list_push(&heap->empty_slabs, slab);
+    return 1;
+  }
+  if (was_full)
+    slab_list_push(list, slab);
+  return 0;
+}
+
+void slab_purge(Heap *heap) {
+  for (Slab *slab = heap->empty_slabs; slab != NULL; slab = slab->next) {
+    if (!slab->purged) {
+      page_purge((char *)slab + PAGE_DIV, SLAB_SIZE - PAGE_DIV);
+      slab->purged = 1;
+    }
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef SLAB_HEADER
+#define SLAB_HEADER
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mymalloc_internal.h"
+
+/* Bounds of the slab region, both NULL when it could not be reserved */
+extern char *slab_region_start;
+extern char *slab_region_end;
+
+static inline int is_slab_object(void *pointer) {
+  return (char *)pointer >= slab_region_start &&
+         (char *)pointer < slab_region_end;
+}
+
+static inline Slab *slab_of(void *pointer) {
+  return (Slab *)((size_t)pointer & ~((size_t)SLAB_SIZE - 1));
+}
+
+/** @brief Reserve the slab region, without it every request goes to the
+    heap blocks */
+void slab_region_init();
+
+/** @brief Give the heap its span of the slab region, with no slabs yet */
+void slab_heap_init(Heap *heap, int16_t heap_index);
+
+/** @brief Decommit every slab of the heap */
+void slab_heap_release(Heap *heap, int16_t heap_index);
+
+/** @brief Allocate an object of at most SLAB_MAX_SIZE bytes, NULL once the
+    heap's span is used up. Called with the heap lock held */
+void *slab_alloc(Heap *heap, int16_t heap_index, size_t size);
+
+/** @brief Free an object, returns 1 if that left its slab empty. Called
+    with the heap lock held */
+int slab_free(Heap *heap, void *pointer);
+
+/** @brief Give back the pages of the empty slabs but their first one */
+void slab_purge(Heap *heap);
+
+#endif /*SLAB_HEADER*/
@@ -1,30 +1,43 @@
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include <CUnit/Basic.h>
 #include <CUnit/CUnit.h>
 
+#include "alloc_log.h"
+#include "log_trace.h"
 #include "mymalloc.h"
 #include "mymalloc_internal.h"
+#include "numa.h"
+#include "page_alloc.h"
+#include "pagemap.h"
+#include "slab.h"
 
 void test_alloc() {
-  char *string = (char *)my_malloc(6);
+  const size_t size = SLAB_MAX_SIZE + 6;
+  char *string = (char *)my_malloc(size);
   BlockHeader *block = (BlockHeader *)((char *)(string)-BLOCK_SIZE);
   CU_ASSERT_FATAL(string != NULL);
   strcpy(string, "Hello");
   CU_ASSERT((size_t)(string) % MEM_ALIGN == 0);
   CU_ASSERT(string - (char *)block == BLOCK_SIZE);
-  BlockHeader *block2 = (BlockHeader *)(string + 8);
-  CU_ASSERT(block->next == block2);
-  CU_ASSERT(block->previous == NULL);
-  char *string2 = (char *)my_malloc(10);
+  BlockHeader *block2 = (BlockHeader *)(string + fit_to_memalign(size));
+  CU_ASSERT(block->previous_footer == (MY_BLOCK_OCCUPIED | MY_BLOCK_FENCE));
+  CU_ASSERT(block2->previous_footer == (block->size | MY_BLOCK_OCCUPIED));
+  char *string2 = (char *)my_malloc(SLAB_MAX_SIZE + 10);
   CU_ASSERT_FATAL(string2 != NULL);
-  CU_ASSERT(block2->size == 16);
-  BlockHeader *block3 = (BlockHeader *)(string2 + 16);
-  CU_ASSERT(block2->next == block3);
-  CU_ASSERT(block2->previous == NULL);
+  CU_ASSERT(block2->size == SLAB_MAX_SIZE + 16);
+  BlockHeader *block3 = (BlockHeader *)(string2 + SLAB_MAX_SIZE + 16);
+  CU_ASSERT(block3->previous_footer == (block2->size | MY_BLOCK_OCCUPIED));
   CU_ASSERT(block3->flags == 0);
   CU_ASSERT(string2 - (char *)block2 == BLOCK_SIZE);
   strcpy(string2, " World");
@@ -52,16 +65,714 @@ void test_10_allocs() {
 }
 
 void test_merge_free() {
-  char *string1 = (char *)my_malloc(6);
+  char *string1 = (char *)my_malloc(SLAB_MAX_SIZE + 6);
   BlockHeader *block = (BlockHeader *)((char *)(string1)-BLOCK_SIZE);
-  char *string2 = (char *)my_malloc(10);
-  char *string3 = (char *)my_malloc(30);
+  char *string2 = (char *)my_malloc(SLAB_MAX_SIZE + 10);
+  char *string3 = (char *)my_malloc(SLAB_MAX_SIZE + 30);
   my_free(string1);
   my_free(string3);
   my_free(string2);
+  tcache_flush();
+
+  CU_ASSERT(block->size >= 3 * (SLAB_MAX_SIZE + 32) + 2 * BLOCK_SIZE);
+
+  my_cleanup();
+}
+
+void test_boundary_tags() {
+  const size_t size = 2 * SLAB_MAX_SIZE;
+  char *left = (char *)my_malloc(size);
+  char *middle = (char *)my_malloc(size);
+  char *right = (char *)my_malloc(size);
+  char *guard = (char *)my_malloc(size);
+  BlockHeader *block = (BlockHeader *)(left - BLOCK_SIZE);
+  BlockHeader *guard_block = (BlockHeader *)(guard - BLOCK_SIZE);
+  my_free(left);
+  my_free(right);
+  CU_ASSERT(guard_block->previous_footer == size);
+  /* Merges with both neighbours at once */
+  my_free(middle);
+  CU_ASSERT(block->size == 3 * size + 2 * BLOCK_SIZE);
+  CU_ASSERT(guard_block->previous_footer == block->size);
+  my_free(guard);
+  my_cleanup();
+}
+
+/* Thread 1 of process 1 mallocs TRACE_TEST_BLOCKS blocks, thread 2 frees
+   them and thread 3 takes the same addresses again, but the run of thread
+   3 is in the file before the one of thread 2. A record that was never
+   written sits between runs. Process 2 frees one of the addresses. In
+   process 3 each of TRACE_TEST_THREADS threads mallocs and frees a block
+   and exits, like the threads of a churning pool */
+#define TRACE_TEST_BLOCKS 100
+#define TRACE_TEST_THREADS 5000
+#define TRACE_TEST_RECORDS (3 * TRACE_TEST_BLOCKS + 2 + 2 * TRACE_TEST_THREADS)
+#define TRACE_TEST_FILE "test_trace.log"
+
+static LogRecord trace_test_record(uint32_t process, uint32_t thread,
+                                   uint64_t sequence, LogOp op, int block) {
+  LogRecord record = {0};
+  record.sequence = sequence;
+  record.time_ns = sequence;
+  record.address = 0x10000 + (uint64_t)block * 64;
+  record.size = op == LOG_OP_FREE ? 0 : 64;
+  record.thread_id = process << LOG_THREAD_BITS | thread;
+  record.op = (uint8_t)op;
+  return record;
+}
+
+static void make_test_trace(LogRecord *records) {
+  LogRecord *record = records;
+  for (int i = 0; i < TRACE_TEST_BLOCKS; i++) {
+    *record++ = trace_test_record(1, 1, i, LOG_OP_MALLOC, i);
+  }
+  *record++ = (LogRecord){0};
+  for (int i = 0; i < TRACE_TEST_BLOCKS; i++) {
+    *record++ = trace_test_record(1, 3, 2 * TRACE_TEST_BLOCKS + i,
+                                  LOG_OP_MALLOC, i);
+  }
+  for (int i = 0; i < TRACE_TEST_BLOCKS; i++) {
+    *record++ =
+        trace_test_record(1, 2, TRACE_TEST_BLOCKS + i, LOG_OP_FREE, i);
+  }
+  *record++ = trace_test_record(2, 1, 3 * TRACE_TEST_BLOCKS, LOG_OP_FREE, 0);
+  for (int i = 0; i < TRACE_TEST_THREADS; i++) {
+    uint64_t sequence = 3 * TRACE_TEST_BLOCKS + 1 + 2 * (uint64_t)i;
+    *record++ = trace_test_record(3, (uint32_t)i + 1, sequence,
+                                  LOG_OP_MALLOC, 0);
+    *record++ = trace_test_record(3, (uint32_t)i + 1, sequence + 1,
+                                  LOG_OP_FREE, 0);
+  }
+}
+
+/* The synthetic trace comes out in order and is written to
+   TRACE_TEST_FILE for the log_reader test */
+void test_trace_order() {
+  static LogRecord records[TRACE_TEST_RECORDS];
+  make_test_trace(records);
+  Trace trace = {NULL, 0, records, records + TRACE_TEST_RECORDS};
+  TraceCursor cursor;
+  AddressTable table;
+  trace_cursor_init(&cursor, &trace);
+  table_init(&table);
+  const LogRecord *record, *previous = NULL;
+  size_t count = 0, unmatched = 0;
+  while ((record = trace_cursor_next(&cursor)) != NULL) {
+    uint32_t process = LOG_PROCESS_OF(record->thread_id);
+    if (previous != NULL)
+      CU_ASSERT(record->sequence == previous->sequence + 1);
+    TraceEntry *entry = table_find(&table, process, record->address);
+    if (record->op == LOG_OP_MALLOC) {
+      CU_ASSERT(entry == NULL);
+      table_insert(&table, process, record->address);
+    } else if (entry != NULL) {
+      table_remove(&table, entry);
+    } else {
+      unmatched++;
+    }
+    previous = record;
+    count++;
+  }
+  CU_ASSERT(count == TRACE_TEST_RECORDS - 1);
+  CU_ASSERT(table.count == TRACE_TEST_BLOCKS);
+  CU_ASSERT(unmatched == 1);
+  trace_cursor_free(&cursor);
+  table_free(&table);
+
+  LogFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+  header.version = LOG_VERSION;
+  header.record_size = sizeof(LogRecord);
+  header.end = sizeof(header) + sizeof(records);
+  FILE *file = fopen(TRACE_TEST_FILE, "wb");
+  CU_ASSERT_FATAL(file != NULL);
+  CU_ASSERT(fwrite(&header, sizeof(header), 1, file) == 1);
+  CU_ASSERT(fwrite(records, sizeof(records), 1, file) == 1);
+  fclose(file);
+  CU_ASSERT_FATAL(trace_open(&trace, TRACE_TEST_FILE));
+  CU_ASSERT(trace.last - trace.first == TRACE_TEST_RECORDS);
+  trace_close(&trace);
+}
+
+/* A malloc and the free of the same block are logged in that order. The
+   file holds earlier runs and the test_fork children too, the size tells
+   this block apart */
+void test_trace_log() {
+  size_t size = 1000 + (size_t)getpid() % 1000;
+  char *pointer = (char *)my_malloc(size);
+  CU_ASSERT_FATAL(pointer != NULL);
+  my_free(pointer);
+  log_flush_all();
+  Trace trace;
+  CU_ASSERT_FATAL(trace_open(&trace, LOG_FILE));
+  TraceCursor cursor;
+  trace_cursor_init(&cursor, &trace);
+  const LogRecord *record;
+  uint32_t process = 0;
+  int malloc_seen = 0, found = 0;
+  while ((record = trace_cursor_next(&cursor)) != NULL) {
+    if (LOG_PROCESS_OF(record->thread_id) != process) {
+      process = LOG_PROCESS_OF(record->thread_id);
+      malloc_seen = 0;
+    }
+    if (record->address != (uint64_t)(uintptr_t)pointer)
+      continue;
+    if (record->op == LOG_OP_MALLOC && record->size == size)
+      malloc_seen = 1;
+    else if (record->op == LOG_OP_FREE && malloc_seen)
+      found = 1;
+  }
+  CU_ASSERT(found);
+  trace_cursor_free(&cursor);
+  trace_close(&trace);
+}
+
+static size_t trace_log_records() {
+  Trace trace;
+  log_flush_all();
+  if (!trace_open(&trace, LOG_FILE))
+    return 0;
+  size_t records = (size_t)(trace.last - trace.first);
+  trace_close(&trace);
+  return records;
+}
+
+/* Nothing is recorded while logging is off */
+void test_logging_off() {
+  void *pointers[8];
+  size_t records = trace_log_records();
+  my_malloc_set_logging(0);
+  char *pointer = (char *)my_malloc(100);
+  pointer = (char *)my_realloc(pointer, 10000);
+  CU_ASSERT_FATAL(pointer != NULL);
+  my_free(pointer);
+  my_free(my_aligned_alloc(64, 100));
+  CU_ASSERT(my_malloc_batch(100, 8, pointers) == 8);
+  my_free_batch(pointers, 8);
+  CU_ASSERT(trace_log_records() == records);
+  my_malloc_set_logging(1);
+}
+
+/* Frees of memory that is not the allocator's are refused, not logged */
+void test_foreign_free_log() {
+  int local = 0;
+  void *pointers[2] = {&local, &local};
+  size_t records = trace_log_records();
+  my_free(&local);
+  my_free_batch(pointers, 2);
+  CU_ASSERT(trace_log_records() == records);
+}
+
+void test_page_map() {
+  char *small = (char *)my_malloc(SLAB_MAX_SIZE);
+  char *medium = (char *)my_malloc(SLAB_MAX_SIZE + 1);
+  char *large = (char *)my_malloc(2 * MMAP_THRESHOLD);
+  CU_ASSERT_FATAL(small != NULL && medium != NULL && large != NULL);
+  PageInfo info = pagemap_get(small);
+  CU_ASSERT(info.kind == PAGE_KIND_SLAB && info.object_size == SLAB_MAX_SIZE);
+  CU_ASSERT(info.heap_index == slab_of(small)->heap_index);
+  info = pagemap_get(medium);
+  CU_ASSERT(info.kind == PAGE_KIND_HEAP && info.heap_index >= 0);
+  info = pagemap_get(large);
+  CU_ASSERT(info.kind == PAGE_KIND_MAPPED && info.heap_index == -1);
+  /* Memory that is not the allocator's is left alone */
+  char local[64];
+  CU_ASSERT(pagemap_get(local).kind == PAGE_KIND_NONE);
+  my_free(local);
+  my_free(large);
+  CU_ASSERT(pagemap_get(large).kind == PAGE_KIND_NONE);
+  my_free(medium);
+  my_free(small);
+  my_cleanup();
+  CU_ASSERT(pagemap_get(medium).kind == PAGE_KIND_NONE);
+  CU_ASSERT(pagemap_get(small).kind == PAGE_KIND_NONE);
+}
+
+static void *thread_numa(void *arg) {
+  int node;
+  int cpu = numa_getcpu(&node);
+  if (cpu >= 0) {
+    /* Stay on the node the heap is expected from */
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+  char *string = (char *)my_malloc(SLAB_MAX_SIZE + 1);
+  CU_ASSERT(pagemap_get(string).heap_index % 2 == node);
+  my_free(string);
+  return NULL;
+}
+
+void test_numa() {
+  MyMallocStats stats;
+  my_malloc_set_numa(1, 2);
+  CU_ASSERT(numa_nodes == 2);
+  /* Both nodes have as many heaps */
+  CU_ASSERT(my_malloc_stats(&stats, NULL, 0) % 2 == 0);
+  pthread_t thread;
+  CU_ASSERT_FATAL(pthread_create(&thread, NULL, thread_numa, NULL) == 0);
+  CU_ASSERT_FATAL(pthread_join(thread, NULL) == 0);
+  my_malloc_set_numa(0, 0);
+  CU_ASSERT(numa_nodes == 1);
+  my_cleanup();
+}
+
+/* Runs last, it leaves MAX_HEAPS heaps in use */
+void test_numa_heap_count() {
+  MyMallocStats stats;
+  my_malloc_set_numa(1, MAX_HEAPS);
+  CU_ASSERT(numa_nodes == MAX_HEAPS);
+  CU_ASSERT(my_malloc_stats(&stats, NULL, 0) == MAX_HEAPS);
+  /* 129 heaps would be needed for 3 nodes, the 128 in use are kept */
+  my_malloc_set_numa(1, 3);
+  CU_ASSERT(numa_nodes == 1);
+  CU_ASSERT(my_malloc_stats(&stats, NULL, 0) == MAX_HEAPS);
+  my_malloc_set_numa(0, 0);
+  my_cleanup();
+}
+
+void test_batch() {
+  const size_t count = 64;
+  const size_t size = SLAB_MAX_SIZE + 100;
+  void *small[64], *medium[64], *large[2];
+  MyMallocStats stats;
+  my_malloc_stats(&stats, NULL, 0);
+  size_t in_use = stats.total.in_use_bytes;
+  CU_ASSERT_FATAL(my_malloc_batch(24, count, small) == count);
+  CU_ASSERT_FATAL(my_malloc_batch(size, count, medium) == count);
+  CU_ASSERT_FATAL(my_malloc_batch(2 * MMAP_THRESHOLD, 2, large) == 2);
+  for (size_t i = 0; i < count; i++) {
+    CU_ASSERT(my_malloc_usable_size(small[i]) >= 24);
+    memset(small[i], 'a', 24);
+    memset(medium[i], 'a', size);
+  }
+  /* Heap blocks are carved one after the other from one free region */
+  for (size_t i = 1; i < count; i++) {
+    CU_ASSERT((char *)medium[i] ==
+              (char *)medium[i - 1] + fit_to_memalign(size) + BLOCK_SIZE);
+  }
+  small[3] = NULL;
+  my_free_batch(small, count);
+  my_free_batch(medium, count);
+  my_free_batch(large, 2);
+  tcache_flush();
+  my_malloc_stats(&stats, NULL, 0);
+  CU_ASSERT(stats.large_blocks == 0);
+  /* small[3] still counts */
+  CU_ASSERT(stats.total.in_use_bytes == in_use + fit_to_memalign(24));
+  my_cleanup();
+}
+
+void test_arena() {
+  MyArena *arena = my_arena_create();
+  CU_ASSERT_FATAL(arena != NULL);
+  char *first = (char *)my_arena_alloc(arena, 10);
+  char *second = (char *)my_arena_alloc(arena, 10);
+  CU_ASSERT_FATAL(first != NULL && second != NULL);
+  CU_ASSERT((size_t)first % MEM_ALIGN == 0);
+  CU_ASSERT(second == first + MEM_ALIGN);
+  /* Spills over into new chunks, one of them for the large allocation */
+  char *last = NULL;
+  for (int i = 0; i < 1000; i++) {
+    last = (char *)my_arena_alloc(arena, 1000);
+    CU_ASSERT_FATAL(last != NULL);
+    memset(last, 'a', 1000);
+  }
+  char *large = (char *)my_arena_alloc(arena, 4 * ARENA_CHUNK_MAX_SIZE);
+  CU_ASSERT_FATAL(large != NULL);
+  memset(large, 'a', 4 * ARENA_CHUNK_MAX_SIZE);
+  /* Allocations start over in the same chunks */
+  my_arena_reset(arena);
+  CU_ASSERT(my_arena_alloc(arena, 10) == first);
+  for (int i = 0; i < 1000; i++) {
+    CU_ASSERT_FATAL(my_arena_alloc(arena, 1000) != NULL);
+  }
+  CU_ASSERT(my_arena_alloc(arena, 1000) == last + 1008);
+  CU_ASSERT(my_arena_alloc(arena, 4 * ARENA_CHUNK_MAX_SIZE) == large);
+  /* Sizes whose rounding wraps around, and sizes no chunk can hold */
+  CU_ASSERT(my_arena_alloc(arena, SIZE_MAX) == NULL);
+  CU_ASSERT(my_arena_alloc(arena, SIZE_MAX - MEM_ALIGN + 1) == NULL);
+  CU_ASSERT(my_arena_alloc(arena, SIZE_MAX - MEM_ALIGN) == NULL);
+  CU_ASSERT(my_arena_alloc(arena, 10) != NULL);
+  my_arena_destroy(arena);
+}
+
+void test_chunk_pool() {
+  MyMallocStats stats;
+  my_cleanup();
+  my_malloc_set_chunk_pool(POOL_MAX_BYTES, 2 * CHUNK_ALIGN);
+  my_malloc_stats(&stats, NULL, 0);
+  CU_ASSERT(stats.pooled_bytes == 2 * CHUNK_ALIGN);
+  /* The first growth of the heap takes a warm chunk */
+  char *small = (char *)my_malloc(1000);
+  CU_ASSERT_FATAL(small != NULL);
+  memset(small, 'a', 1000);
+  my_malloc_stats(&stats, NULL, 0);
+  CU_ASSERT(stats.pooled_bytes == CHUNK_ALIGN);
+  /* A large allocation is cut from the other one and goes back on free */
+  size_t size = MMAP_THRESHOLD * 4;
+  size_t length = size + PAGE_DIV;
+  char *large = (char *)my_malloc(size);
+  CU_ASSERT_FATAL(large != NULL);
+  my_malloc_stats(&stats, NULL, 0);
+  CU_ASSERT(stats.pooled_bytes == CHUNK_ALIGN - length);
+  memset(large, 'a', size);
+  my_free(large);
+  my_malloc_stats(&stats, NULL, 0);
+  CU_ASSERT(stats.pooled_bytes == CHUNK_ALIGN);
+  /* Pooled memory is not zeroed like a fresh mapping */
+  char *zeroed = (char *)my_calloc(1, size);
+  CU_ASSERT_FATAL(zeroed != NULL);
+  CU_ASSERT(zeroed[0] == 0 && zeroed[size - 1] == 0);
+  my_free(zeroed);
+  my_free(small);
+  my_cleanup();
+  my_malloc_stats(&stats, NULL, 0);
+  CU_ASSERT(stats.pooled_bytes == 0);
+}
+
+void test_hugetlb_chunks() {
+  MyMallocStats stats;
+  char *blocks[4];
+  my_cleanup();
+  my_malloc_set_chunk_pool(POOL_MAX_BYTES, 0);
+  my_malloc_set_huge_pages(MY_HUGE_PAGES_HUGETLB);
+  my_malloc_set_mmap_threshold(SIZE_MAX);
+  my_malloc_set_purge_decay(0);
+  /* Each takes a chunk of its own */
+  for (int i = 0; i < 4; i++) {
+    blocks[i] = (char *)my_malloc(CHUNK_MIN_SIZE);
+    CU_ASSERT_FATAL(blocks[i] != NULL);
+    memset(blocks[i], 'a', CHUNK_MIN_SIZE);
+  }
+  /* Without hugetlbfs pages configured the chunks have normal ones */
+  int hugetlb = pagemap_get(blocks[0]).hugetlb;
+  void *probe = page_alloc_hugetlb(CHUNK_ALIGN, CHUNK_ALIGN);
+  CU_ASSERT(hugetlb || probe == NULL);
+  if (probe != NULL)
+    page_free(probe, CHUNK_ALIGN);
+  for (int i = 0; i < 4; i++) {
+    my_free(blocks[i]);
+  }
+  /* The empty chunks beyond the retained one are unmapped, not pooled */
+  my_malloc_stats(&stats, NULL, 0);
+  CU_ASSERT(hugetlb ? stats.pooled_bytes == 0 : stats.pooled_bytes > 0);
+  my_malloc_set_purge_decay(PURGE_DECAY_MS);
+  my_malloc_set_mmap_threshold(MMAP_THRESHOLD);
+  my_malloc_set_huge_pages(MY_HUGE_PAGES_OFF);
+  my_cleanup();
+}
+
+void *thread_exit_heap(void *threads) {
+  MyMallocStats stats;
+  /* Left in the thread cache */
+  my_free(my_malloc(100));
+  my_malloc_stats(&stats, NULL, 0);
+  *(size_t *)threads = stats.total.threads;
+  return NULL;
+}
+
+void test_thread_exit() {
+#ifndef MYMALLOC_NO_THREADING
+  MyMallocStats stats;
+  my_free(my_malloc(100));
+  tcache_flush();
+  my_malloc_stats(&stats, NULL, 0);
+  size_t threads = stats.total.threads;
+  size_t in_use = stats.total.in_use_bytes;
+  size_t running = 0;
+  pthread_t thread;
+  CU_ASSERT_FATAL(
+      pthread_create(&thread, NULL, thread_exit_heap, &running) == 0);
+  CU_ASSERT_FATAL(pthread_join(thread, NULL) == 0);
+  CU_ASSERT(running == threads + 1);
+  /* The exited thread gave its heap up and its cache back */
+  my_malloc_stats(&stats, NULL, 0);
+  CU_ASSERT(stats.total.threads == threads);
+  CU_ASSERT(stats.total.in_use_bytes == in_use);
+#endif
+}
+
+/* More threads than an int16_t counts */
+#define CHURN_TEST_THREADS 33000
+
+void *thread_churn(void *unused) {
+  my_free(my_malloc(100));
+  return NULL;
+}
+
+void test_thread_churn() {
+#ifndef MYMALLOC_NO_THREADING
+  MyMallocStats stats;
+  char *live = (char *)my_malloc(1000);
+  CU_ASSERT_FATAL(live != NULL);
+  memset(live, 'a', 1000);
+  tcache_flush();
+  my_malloc_stats(&stats, NULL, 0);
+  size_t in_use = stats.total.in_use_bytes;
+  size_t heap_count = stats.heap_count;
+  for (int i = 0; i < CHURN_TEST_THREADS; i++) {
+    pthread_t thread;
+    CU_ASSERT_FATAL(pthread_create(&thread, NULL, thread_churn, NULL) == 0);
+    CU_ASSERT_FATAL(pthread_join(thread, NULL) == 0);
+  }
+  /* Still the same heaps, holding the same memory */
+  my_malloc_stats(&stats, NULL, 0);
+  CU_ASSERT(stats.total.in_use_bytes == in_use);
+  CU_ASSERT(stats.heap_count == heap_count);
+  CU_ASSERT(live[0] == 'a' && live[999] == 'a');
+  my_free(live);
+#endif
+}
+
+static atomic_int fork_test_running;
+
+void *thread_fork_allocate(void *unused) {
+  while (fork_test_running) {
+    my_free(my_malloc(1000));
+  }
+  return NULL;
+}
+
+/* The child allocates while another thread of the parent was allocating
+   at the time of the fork, and only counts its own thread */
+void test_fork() {
+#ifndef MYMALLOC_NO_THREADING
+  fork_test_running = 1;
+  pthread_t thread;
+  CU_ASSERT_FATAL(
+      pthread_create(&thread, NULL, thread_fork_allocate, NULL) == 0);
+  for (int i = 0; i < 20; i++) {
+    pid_t child = fork();
+    CU_ASSERT_FATAL(child >= 0);
+    if (child == 0) {
+      MyMallocStats stats;
+      for (int j = 0; j < 1000; j++) {
+        my_free(my_malloc(j));
+      }
+      my_malloc_stats(&stats, NULL, 0);
+      _exit(stats.total.threads == 1 ? 0 : 1);
+    }
+    int status;
+    CU_ASSERT_FATAL(waitpid(child, &status, 0) == child);
+    CU_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  fork_test_running = 0;
+  CU_ASSERT_FATAL(pthread_join(thread, NULL) == 0);
+#endif
+}
+
+#define LOCK_TEST_INCREMENTS 100000
+
+static Lock test_lock_lock = LOCK_INITIALIZER;
+static long test_lock_counter = 0;
+
+void *thread_lock(void *unused) {
+  for (int i = 0; i < LOCK_TEST_INCREMENTS; i++) {
+    lock_acquire(test_lock_lock);
+    test_lock_counter++;
+    lock_release(test_lock_lock);
+  }
+  return NULL;
+}
+
+void test_lock() {
+#ifndef MYMALLOC_NO_THREADING
+  CU_ASSERT(lock_try_acquire(test_lock_lock) == 0);
+  CU_ASSERT(lock_try_acquire(test_lock_lock) != 0);
+  lock_release(test_lock_lock);
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++) {
+    CU_ASSERT_FATAL(pthread_create(threads + i, NULL, thread_lock, NULL) == 0);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  CU_ASSERT(test_lock_counter == 4 * LOCK_TEST_INCREMENTS);
+#endif
+}
+
+void test_size_class_bins() {
+  char *small = (char *)my_malloc(24);
+  char *guard1 = (char *)my_malloc(8);
+  char *large = (char *)my_malloc(1000);
+  char *guard2 = (char *)my_malloc(8);
+  my_free(small);
+  my_free(large);
+  /* Each request is served from the smallest non-empty fitting class */
+  char *fit_large = (char *)my_malloc(900);
+  CU_ASSERT_PTR_EQUAL(fit_large, large);
+  char *fit_small = (char *)my_malloc(20);
+  CU_ASSERT_PTR_EQUAL(fit_small, small);
+  my_free(guard1);
+  my_free(guard2);
+  my_cleanup();
+}
+
+void test_thread_cache() {
+  char *string1 = (char *)my_malloc(40);
+  CU_ASSERT_FATAL(is_slab_object(string1));
+  Slab *slab = slab_of(string1);
+  char *guard = (char *)my_malloc(8);
+  my_free(string1);
+  /* Cached objects stay used in their slab */
+  CU_ASSERT(slab->used == 1);
+  char *string2 = (char *)my_malloc(33);
+  CU_ASSERT_PTR_EQUAL(string1, string2);
+  my_free(string2);
+  tcache_flush();
+  CU_ASSERT(slab->used == 0);
+  my_free(guard);
+  my_cleanup();
+}
+
+void *thread_remote_free(void *args) {
+  char *pointer = (char *)args;
+  BlockHeader *block = (BlockHeader *)(pointer - BLOCK_SIZE);
+  my_free(pointer);
+  if (thread_index != block->heap_index) {
+    /* Queued on the owning heap, not merged yet */
+    CU_ASSERT(block->flags & MY_BLOCK_OCCUPIED);
+  } else {
+    CU_ASSERT(!(block->flags & MY_BLOCK_OCCUPIED));
+  }
+  return NULL;
+}
+
+void test_remote_free() {
+  const size_t size = 2 * TCACHE_MAX_SIZE;
+  char *string1 = (char *)my_malloc(size);
+  BlockHeader *block = (BlockHeader *)(string1 - BLOCK_SIZE);
+  char *guard = (char *)my_malloc(size);
+  pthread_t thread;
+  CU_ASSERT_FATAL(pthread_create(&thread, NULL, thread_remote_free, string1) ==
+                  0);
+  CU_ASSERT_FATAL(pthread_join(thread, NULL) == 0);
+  /* The next allocation on the owning heap merges the queued block */
+  char *string2 = (char *)my_malloc(size);
+  CU_ASSERT_PTR_EQUAL(string1, string2);
+  CU_ASSERT(block->flags & MY_BLOCK_OCCUPIED);
+  my_free(string2);
+  my_free(guard);
+  my_cleanup();
+}
+
+void test_large_alloc() {
+  const size_t size = 4 * MMAP_THRESHOLD;
+  char *string = (char *)my_malloc(size);
+  CU_ASSERT_FATAL(string != NULL);
+  BlockHeader *block = (BlockHeader *)(string - BLOCK_SIZE);
+  CU_ASSERT(block->flags & MY_BLOCK_MAPPED);
+  CU_ASSERT((size_t)block % PAGE_DIV == 0);
+  for (size_t i = 0; i < size; i++) {
+    string[i] = (char)i;
+  }
+  char *grown = (char *)my_realloc(string, 4 * size);
+  CU_ASSERT_FATAL(grown != NULL);
+  int same = 1;
+  for (size_t i = 0; i < size; i++) {
+    same &= grown[i] == (char)i;
+  }
+  CU_ASSERT(same);
+  grown[4 * size - 1] = 1;
+  char *shrunk = (char *)my_realloc(grown, 100);
+  CU_ASSERT_FATAL(shrunk != NULL);
+  block = (BlockHeader *)(shrunk - BLOCK_SIZE);
+  CU_ASSERT(!(block->flags & MY_BLOCK_MAPPED));
+  CU_ASSERT(shrunk[99] == (char)99);
+  my_free(shrunk);
+
+  my_malloc_set_mmap_threshold(PAGE_DIV);
+  string = (char *)my_malloc(PAGE_DIV);
+  block = (BlockHeader *)(string - BLOCK_SIZE);
+  CU_ASSERT(block->flags & MY_BLOCK_MAPPED);
+  my_free(string);
+  my_malloc_set_mmap_threshold(MMAP_THRESHOLD);
+  my_cleanup();
+}
+
+static int is_mapped(void *pointer) {
+  return msync((void *)((size_t)pointer / PAGE_DIV * PAGE_DIV), PAGE_DIV,
+               MS_ASYNC) == 0;
+}
+
+void test_purge() {
+  /* Too large for two to fit the first growth of the heap */
+  const size_t size = CHUNK_MIN_SIZE / 2 + PURGE_MIN_SIZE;
+  my_malloc_set_mmap_threshold(SIZE_MAX);
+  my_malloc_set_purge_decay(0);
+  char *string1 = (char *)my_malloc(size);
+  char *string2 = (char *)my_malloc(size);
+  CU_ASSERT_FATAL(string1 != NULL && string2 != NULL);
+  memset(string1, 'a', size);
+  memset(string2, 'a', size);
+  my_free(string1);
+  my_free(string2);
+  /* The heap's span stays committed, with the pages of its now single
+     free block purged */
+  CU_ASSERT(is_mapped(string1) && is_mapped(string2));
+  BlockHeader *block = (BlockHeader *)(string1 - BLOCK_SIZE);
+  CU_ASSERT(block->flags & MY_BLOCK_PURGED);
+  CU_ASSERT(string1[size / 2] == 0 && string2[size / 2] == 0);
+  my_malloc_set_purge_decay(PURGE_DECAY_MS);
+  my_malloc_set_mmap_threshold(MMAP_THRESHOLD);
+  my_cleanup();
+}
 
-  CU_ASSERT(block->size >= 142);
+void test_chunk_growth() {
+  MyMallocStats stats;
+  my_malloc_set_mmap_threshold(SIZE_MAX);
+  my_malloc_stats(&stats, NULL, 0);
+  size_t mapped = stats.total.mapped_bytes;
+  char *first = (char *)my_malloc(CHUNK_MIN_SIZE / 2);
+  CU_ASSERT_FATAL(first != NULL);
+  CU_ASSERT(((size_t)first & (CHUNK_ALIGN - 1)) < PAGE_DIV);
+  my_malloc_stats(&stats, NULL, 0);
+  CU_ASSERT(stats.total.mapped_bytes - mapped == CHUNK_MIN_SIZE);
+  /* The heap grows in place, by twice as much as the first time */
+  char *second = (char *)my_malloc(CHUNK_MIN_SIZE / 2 + PURGE_MIN_SIZE);
+  CU_ASSERT_FATAL(second != NULL);
+  CU_ASSERT(second == first + CHUNK_MIN_SIZE / 2 + BLOCK_SIZE);
+  my_malloc_stats(&stats, NULL, 0);
+  CU_ASSERT(stats.total.mapped_bytes - mapped == 3 * CHUNK_MIN_SIZE);
+  /* Requests larger than the next growth get their own size */
+  char *huge = (char *)my_malloc(8 * CHUNK_MIN_SIZE);
+  CU_ASSERT_FATAL(huge != NULL);
+  my_malloc_stats(&stats, NULL, 0);
+  CU_ASSERT(stats.total.mapped_bytes - mapped == 12 * CHUNK_MIN_SIZE);
+  my_free(first);
+  my_free(second);
+  my_free(huge);
+  my_malloc_set_mmap_threshold(MMAP_THRESHOLD);
+  my_cleanup();
+}
 
+void test_stats() {
+  MyMallocStats stats;
+  char *string = (char *)my_malloc(1000);
+  char *large = (char *)my_malloc(2 * MMAP_THRESHOLD);
+  CU_ASSERT_FATAL(string != NULL && large != NULL);
+  BlockHeader *block = (BlockHeader *)(string - BLOCK_SIZE);
+  size_t heap_count = my_malloc_stats(&stats, NULL, 0);
+  CU_ASSERT(heap_count >= 1 && stats.heap_count == heap_count);
+  CU_ASSERT(stats.total.in_use_bytes >= block->size);
+  CU_ASSERT(stats.total.mapped_bytes >= stats.total.in_use_bytes);
+  CU_ASSERT(stats.total.free_blocks >= 1);
+  CU_ASSERT(stats.total.largest_free_block <= stats.total.free_bytes);
+  CU_ASSERT(stats.large_blocks >= 1);
+  CU_ASSERT(stats.large_mapped_bytes >= 2 * MMAP_THRESHOLD);
+  size_t in_use = stats.total.in_use_bytes - block->size;
+  size_t large_mapped = stats.large_mapped_bytes;
+  my_free(string);
+  my_free(large);
+  MyHeapStats heap_stats[4];
+  my_malloc_stats(&stats, heap_stats, 4);
+  CU_ASSERT(stats.total.in_use_bytes == in_use);
+  CU_ASSERT(stats.large_mapped_bytes < large_mapped);
+  CU_ASSERT(heap_stats[0].fragmentation >= 0.0 &&
+            heap_stats[0].fragmentation <= 1.0);
   my_cleanup();
 }
 
@@ -69,17 +780,26 @@ void test_too_huge_alloc() {
 #if INTPTR_MAX == INT64_MAX
   CU_ASSERT(my_malloc(0x6FFFFFFFFFFF) == NULL);
 #endif
+  /* Sizes that wrap when rounded up fail on the heap path too */
+  void *pointers[2];
+  my_malloc_set_mmap_threshold(SIZE_MAX);
+  CU_ASSERT(my_malloc(SIZE_MAX - 5) == NULL);
+  CU_ASSERT(my_malloc(SIZE_MAX - BLOCK_SIZE) == NULL);
+  CU_ASSERT(my_calloc(1, SIZE_MAX - 5) == NULL);
+  CU_ASSERT(my_aligned_alloc(64, SIZE_MAX - 5) == NULL);
+  CU_ASSERT(my_malloc_batch(SIZE_MAX - 5, 2, pointers) == 0);
+  my_malloc_set_mmap_threshold(MMAP_THRESHOLD);
   my_cleanup();
 }
 
 void test_first_fit() {
   char *string1 = (char *)my_malloc(6);
   char *string2 = (char *)my_malloc(18);
-  char *string3 = (char *)my_malloc(12);
+  char *string3 = (char *)my_malloc(24);
   char *string4 = (char *)my_malloc(30);
   my_free(string3);
   my_free(string1);
-  char *string5 = (char *)my_malloc(10);
+  char *string5 = (char *)my_malloc(20);
   CU_ASSERT_PTR_EQUAL(string5, string3);
   my_free(string2);
   my_free(string4);
@@ -97,7 +817,155 @@ void test_realloc() {
   my_cleanup();
 }
 
-#define TEST_NB_THREADS (2 * NUMBER_HEAPS)
+void test_realloc_in_place() {
+  const size_t size = 2 * TCACHE_MAX_SIZE;
+  char *string1 = (char *)my_malloc(size);
+  char *string2 = (char *)my_malloc(size);
+  char *guard = (char *)my_malloc(size);
+  BlockHeader *block = (BlockHeader *)(string1 - BLOCK_SIZE);
+  memset(string1, 'a', size);
+  my_free(string2);
+  /* Grows into the free neighbour */
+  char *grown = (char *)my_realloc(string1, 2 * size);
+  CU_ASSERT_PTR_EQUAL(grown, string1);
+  CU_ASSERT(block->size >= 2 * size);
+  CU_ASSERT(grown[size - 1] == 'a');
+  /* Shrinks by giving the tail back */
+  char *shrunk = (char *)my_realloc(grown, 64);
+  CU_ASSERT_PTR_EQUAL(shrunk, string1);
+  CU_ASSERT(block->size == 64);
+  BlockHeader *tail = (BlockHeader *)(shrunk + 64);
+  CU_ASSERT(!(tail->flags & MY_BLOCK_OCCUPIED));
+  CU_ASSERT(tail->size == 2 * size - 64);
+  /* Moves and copies when the neighbour is taken */
+  memset(shrunk, 'b', 64);
+  char *string3 = (char *)my_malloc(2 * size - 64);
+  CU_ASSERT_PTR_EQUAL(string3, (char *)tail + BLOCK_SIZE);
+  char *moved = (char *)my_realloc(shrunk, size);
+  CU_ASSERT_PTR_NOT_EQUAL(moved, shrunk);
+  CU_ASSERT(moved[0] == 'b' && moved[63] == 'b');
+  /* Sizes that wrap when rounded up leave the block alone */
+  my_malloc_set_mmap_threshold(SIZE_MAX);
+  CU_ASSERT_PTR_NULL(my_realloc(moved, SIZE_MAX - 5));
+  CU_ASSERT(my_malloc_usable_size(moved) >= size);
+  CU_ASSERT(moved[0] == 'b' && moved[63] == 'b');
+  my_malloc_set_mmap_threshold(MMAP_THRESHOLD);
+  my_free(moved);
+  my_free(string3);
+  my_free(guard);
+  my_cleanup();
+}
+
+void test_aligned_alloc() {
+  CU_ASSERT_PTR_NULL(my_aligned_alloc(48, 10));
+  char *before = (char *)my_malloc(8);
+  size_t alignments[] = {16, 32, 64, 256, 4096};
+  char *blocks[5];
+  for (int i = 0; i < 5; i++) {
+    blocks[i] = (char *)my_aligned_alloc(alignments[i], 100);
+    CU_ASSERT_FATAL(blocks[i] != NULL);
+    CU_ASSERT(((size_t)blocks[i] & (alignments[i] - 1)) == 0);
+    CU_ASSERT(my_malloc_usable_size(blocks[i]) >= 100);
+    memset(blocks[i], 'a', 100);
+  }
+  /* The padding in front of an aligned block is free again */
+  BlockHeader *block = (BlockHeader *)(blocks[4] - BLOCK_SIZE);
+  CU_ASSERT(!(block->previous_footer & MY_BLOCK_OCCUPIED));
+  BlockHeader *padding = (BlockHeader *)((char *)block - BLOCK_SIZE -
+                                         block->previous_footer);
+  CU_ASSERT(!(padding->flags & MY_BLOCK_OCCUPIED));
+  CU_ASSERT(padding->size == block->previous_footer);
+  for (int i = 0; i < 5; i++) {
+    my_free(blocks[i]);
+  }
+  my_free(before);
+  my_cleanup();
+}
+
+void test_aligned_padding() {
+  char *fillers[16], *blocks[16];
+  /* Fillers shift the start of the next block by MEM_ALIGN each time */
+  for (int i = 0; i < 16; i++) {
+    fillers[i] = (char *)my_malloc(SLAB_MAX_SIZE + 1 + i * MEM_ALIGN);
+    blocks[i] = (char *)my_aligned_alloc(64, SLAB_MAX_SIZE + 1);
+    CU_ASSERT_FATAL(fillers[i] != NULL && blocks[i] != NULL);
+    CU_ASSERT(((size_t)blocks[i] & 63) == 0);
+    /* Padding left free can hold a free list link */
+    size_t footer = ((BlockHeader *)(blocks[i] - BLOCK_SIZE))->previous_footer;
+    if (!(footer & MY_BLOCK_OCCUPIED))
+      CU_ASSERT((footer & FOOTER_SIZE_MASK) >= MEM_ALIGN);
+  }
+  for (int i = 0; i < 16; i++) {
+    my_free(fillers[i]);
+    my_free(blocks[i]);
+  }
+  my_cleanup();
+}
+
+void *thread_slab_free(void *args) {
+  my_free(args);
+  tcache_flush();
+  return NULL;
+}
+
+void test_slab() {
+  char *objects[8];
+  for (int i = 0; i < 8; i++) {
+    objects[i] = (char *)my_malloc(24);
+    CU_ASSERT_FATAL(is_slab_object(objects[i]));
+    CU_ASSERT((size_t)objects[i] % MEM_ALIGN == 0);
+    memset(objects[i], 'a' + i, 24);
+  }
+  /* Objects of a size class are packed without headers */
+  Slab *slab = slab_of(objects[0]);
+  CU_ASSERT(slab->object_size == 32);
+  CU_ASSERT(slab->used == 8);
+  CU_ASSERT(objects[1] - objects[0] == 32);
+  CU_ASSERT(my_malloc_usable_size(objects[0]) == 32);
+  CU_ASSERT(slab_of(my_malloc(SLAB_MAX_SIZE)) != slab);
+  CU_ASSERT(!is_slab_object(my_malloc(SLAB_MAX_SIZE + 1)));
+  /* Growing out of the size class moves the object */
+  char *grown = (char *)my_realloc(objects[7], 100);
+  CU_ASSERT(grown != objects[7] && grown[23] == 'h');
+  CU_ASSERT_PTR_EQUAL(my_realloc(grown, 90), grown);
+  /* A slab object freed by another thread goes back to its slab */
+  pthread_t thread;
+  CU_ASSERT_FATAL(
+      pthread_create(&thread, NULL, thread_slab_free, objects[0]) == 0);
+  CU_ASSERT_FATAL(pthread_join(thread, NULL) == 0);
+  for (int i = 1; i < 7; i++) {
+    CU_ASSERT(objects[i][0] == 'a' + i);
+    my_free(objects[i]);
+  }
+  tcache_flush();
+  my_free(my_malloc(SLAB_MAX_SIZE + 1));
+  CU_ASSERT(slab->used == 0);
+  my_cleanup();
+}
+
+void test_calloc() {
+  my_free(NULL);
+  char *dirty = (char *)my_malloc(200);
+  memset(dirty, 'x', 200);
+  my_free(dirty);
+  char *zeroed = (char *)my_calloc(50, 4);
+  CU_ASSERT_PTR_NOT_NULL(zeroed);
+  for (int i = 0; i < 200; i++) {
+    CU_ASSERT(zeroed[i] == 0);
+  }
+  CU_ASSERT(my_malloc_usable_size(zeroed) >= 200);
+  CU_ASSERT(my_malloc_usable_size(NULL) == 0);
+  CU_ASSERT_PTR_NULL(my_calloc(SIZE_MAX / 2, 4));
+  /* Aligned blocks can be freed like any other */
+  char *aligned = (char *)my_aligned_alloc(8192, 100);
+  CU_ASSERT(((size_t)aligned & 8191) == 0);
+  CU_ASSERT(my_malloc_usable_size(aligned) >= 100);
+  my_free(aligned);
+  my_free(zeroed);
+  my_cleanup();
+}
+
+#define TEST_NB_THREADS 16
 #define TEST_NB_ALLOCS 10
 
 size_t alloc_size_of_index(int i) { return (size_t)(8 + 2 * i); }
@@ -138,9 +1006,8 @@ void test_threaded() {
   for (int i = 0; i < TEST_NB_THREADS - 1; i++) {
     for (int k = 0; k < TEST_NB_ALLOCS; k++) {
       CU_ASSERT(pointers[i][k] != NULL);
-      BlockHeader *block =
-          (BlockHeader *)((char *)(pointers[i][k]) - BLOCK_SIZE);
-      CU_ASSERT(block->size >= alloc_size_of_index(k));
+      CU_ASSERT(my_malloc_usable_size(pointers[i][k]) >=
+                alloc_size_of_index(k));
     }
   }
 
@@ -185,7 +1052,35 @@ int main(int argc, char *argv[]) {
       (NULL == CU_ADD_TEST(pSuites, test_threaded)) ||
       (NULL == CU_ADD_TEST(pSuites, test_too_huge_alloc)) ||
       (NULL == CU_ADD_TEST(pSuites, test_first_fit)) ||
-      (NULL == CU_ADD_TEST(pSuites, test_realloc))) {
+      (NULL == CU_ADD_TEST(pSuites, test_size_class_bins)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_thread_cache)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_remote_free)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_large_alloc)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_purge)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_chunk_growth)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_stats)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_realloc)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_realloc_in_place)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_calloc)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_aligned_alloc)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_aligned_padding)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_slab)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_boundary_tags)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_page_map)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_numa)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_batch)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_arena)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_chunk_pool)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_hugetlb_chunks)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_lock)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_thread_exit)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_thread_churn)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_fork)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_trace_order)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_trace_log)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_logging_off)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_foreign_free_log)) ||
+      (NULL == CU_ADD_TEST(pSuites, test_numa_heap_count))) {
     CU_cleanup_registry();
     return CU_get_error();
   }
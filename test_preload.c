@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Run with libmymalloc_preload.so in LD_PRELOAD. Calls the libc allocation
+   functions and checks what they return, exits with 1 on the first error */
+
+static int failures = 0;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      fprintf(stderr, "ERROR: %s:%d %s\n", __FILE__, __LINE__, #condition);   \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static void check_malloc() {
+  for (size_t size = 1; size <= (1 << 22); size *= 3) {
+    unsigned char *pointer = malloc(size);
+    CHECK(pointer != NULL);
+    if (pointer == NULL)
+      continue;
+    CHECK((uintptr_t)pointer % 16 == 0);
+    CHECK(malloc_usable_size(pointer) >= size);
+    memset(pointer, 0xa5, size);
+    CHECK(pointer[size - 1] == 0xa5);
+    free(pointer);
+  }
+  free(NULL);
+}
+
+static void check_calloc() {
+  /* Dirty the blocks calloc may get back */
+  for (size_t size = 8; size <= (1 << 20); size *= 4) {
+    void *pointer = malloc(size);
+    memset(pointer, 0xff, size);
+    free(pointer);
+  }
+  for (size_t size = 8; size <= (1 << 20); size *= 4) {
+    unsigned char *pointer = calloc(size, 1);
+    CHECK(pointer != NULL);
+    if (pointer == NULL)
+      continue;
+    size_t nonzero = 0;
+    for (size_t i = 0; i < size; i++)
+      nonzero += pointer[i] != 0;
+    CHECK(nonzero == 0);
+    free(pointer);
+  }
+  volatile size_t count = SIZE_MAX / 2;
+  CHECK(calloc(count, 4) == NULL);
+}
+
+static void check_realloc() {
+  unsigned char *pointer = realloc(NULL, 10);
+  CHECK(pointer != NULL);
+  for (int i = 0; i < 10; i++)
+    pointer[i] = (unsigned char)i;
+  /* Grow through the slab, the bins and mmap sizes, then shrink back */
+  size_t sizes[] = {100, 5000, 1 << 20, 64, 10};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    pointer = realloc(pointer, sizes[s]);
+    CHECK(pointer != NULL);
+    if (pointer == NULL)
+      return;
+    int same = 1;
+    for (int i = 0; i < 10; i++)
+      same &= pointer[i] == (unsigned char)i;
+    CHECK(same);
+  }
+  CHECK(realloc(pointer, 0) == NULL);
+}
+
+static void check_posix_memalign() {
+  for (size_t alignment = sizeof(void *); alignment <= (1 << 21);
+       alignment *= 2) {
+    void *pointer = NULL;
+    CHECK(posix_memalign(&pointer, alignment, 100) == 0);
+    CHECK(pointer != NULL);
+    CHECK((uintptr_t)pointer % alignment == 0);
+    memset(pointer, 1, 100);
+    free(pointer);
+  }
+  void *pointer = NULL;
+  CHECK(posix_memalign(&pointer, 3, 100) != 0);
+  void *aligned = aligned_alloc(64, 128);
+  CHECK(aligned != NULL && (uintptr_t)aligned % 64 == 0);
+  free(aligned);
+}
+
+/* The child allocates and frees blocks of its parent, which keeps going
+   after the child exits */
+static void check_fork() {
+  char *before = strdup("allocated before fork");
+  pid_t pid = fork();
+  CHECK(pid >= 0);
+  if (pid == 0) {
+    char *child = malloc(1000);
+    int ok = child != NULL && strcmp(before, "allocated before fork") == 0;
+    free(child);
+    free(before);
+    _exit(ok ? 0 : 1);
+  }
+  int status = 0;
+  CHECK(waitpid(pid, &status, 0) == pid);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  CHECK(strcmp(before, "allocated before fork") == 0);
+  free(before);
+  void *after = malloc(1000);
+  CHECK(after != NULL);
+  free(after);
+}
+
+/* Run where LOG_FILE cannot be opened, the first operation gives up on
+   logging instead of every one trying the file again */
+static void check_log_unavailable() {
+  free(malloc(100));
+  atomic_int *log_enabled = dlsym(RTLD_DEFAULT, "log_enabled");
+  CHECK(log_enabled != NULL && atomic_load(log_enabled) == 0);
+}
+
+int main(int argc, char *argv[]) {
+  if (dlsym(RTLD_DEFAULT, "my_malloc") == NULL) {
+    fprintf(stderr, "ERROR: libmymalloc_preload.so is not preloaded\n");
+    return 1;
+  }
+  check_malloc();
+  check_calloc();
+  check_realloc();
+  check_posix_memalign();
+  check_fork();
+  if (argc > 1 && strcmp(argv[1], "--log-unavailable") == 0)
+    check_log_unavailable();
+  printf("failures: %d\n", failures);
+  return failures != 0;
+}